@@ -0,0 +1,106 @@
+#ifndef CLIENT_POOL_H
+#define CLIENT_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mem.h"
+#include "network.h"
+
+#define MAX_POOL_SERVERS 8
+
+struct client_server
+{
+    const char *addr;
+    unsigned short port;
+};
+
+// runs on the pool's progress thread, status is 0 or a negative fi_errno
+typedef void (*client_op_cb)(int status, void *arg);
+
+struct client_pool;
+struct client_op;
+
+// how the global address space is spread over the servers
+enum client_layout
+{
+    // server i holds [i * STORE_SIZE, (i + 1) * STORE_SIZE)
+    LAYOUT_CONTIGUOUS = 0,
+    // STRIPE_SIZE units go round robin over the servers, so a large op hits all of them at once
+    LAYOUT_STRIPED,
+    // STRIPE_SIZE units are placed by a consistent hash ring over the servers' addr:port, at the
+    // same offset in every server's store
+    LAYOUT_HASHED
+};
+
+#define STRIPE_SIZE BULK_SIZE
+
+struct client_pool_attr
+{
+    int cxns_per_server;
+    enum client_layout layout;
+    // LAYOUT_HASHED only, writes also go to the next server on the ring
+    bool replicate;
+    // NULL for the defaults
+    const struct net_config *net;
+    // always go through the fabric, even to servers sharing their store on this host
+    bool no_local_path;
+};
+
+/*
+A pool of connections to one or more servers, driven by its own progress thread. Each server
+holds STORE_SIZE bytes of the global address space, laid out as described by attr->layout.
+
+Every submission call is thread safe. A read fetches the remote bytes at op_addr into buf, a
+write stores buf there. An op reaching past the layout's capacity, STORE_SIZE for LAYOUT_HASHED
+and server_count * STORE_SIZE otherwise, fails with -FI_ERANGE. Transfers move through the
+connections' registered bulk buffers in stripes of at most BULK_SIZE, and an op's stripes are
+issued in parallel over every idle connection to the servers they live on. Stripes land directly
+in their slice of buf, so buf doesn't need to be registered but must stay valid until the op
+completes. Only one pool can exist per process, memory registration is process global.
+
+Servers on the same host share their store through shared memory. Stripes for them are copied
+directly, and an op that only touches such servers completes in the submitting thread without
+involving the progress thread.
+
+With the read_cache_size config key set, reads from servers that grant leases go through a cache
+of recently read blocks, see read_cache.h. A read the cache holds completes in the submitting
+thread too.
+*/
+struct client_pool *client_pool_open(const struct client_server *servers, int server_count,
+                                     const struct client_pool_attr *attr);
+void client_pool_close(struct client_pool *pool);
+// overrides the verify config key for stripes started afterwards, stripes in flight finish the way
+// they started. Stripes copied through shared memory are never checked
+void client_pool_set_verify(struct client_pool *pool, bool verify);
+// overrides the compress_min config key, under the same rule. Only servers that agreed to
+// FEATURE_LZ when the pool connected, which needs compress_min set in its config, get compressed
+// stripes
+void client_pool_set_compress(struct client_pool *pool, size_t min_len);
+
+// callback style, the op is freed once cb returns
+int client_read_async(struct client_pool *pool, uint64_t op_addr, void *buf, size_t len,
+                      client_op_cb cb, void *arg);
+int client_write_async(struct client_pool *pool, uint64_t op_addr, const void *buf, size_t len,
+                       client_op_cb cb, void *arg);
+
+// future style, every returned op must be passed to client_op_wait exactly once
+struct client_op *client_read_future(struct client_pool *pool, uint64_t op_addr, void *buf,
+                                     size_t len);
+struct client_op *client_write_future(struct client_pool *pool, uint64_t op_addr,
+                                      const void *buf, size_t len);
+bool client_op_done(struct client_op *op);
+int client_op_wait(struct client_op *op);
+
+// blocking wrappers
+int client_read(struct client_pool *pool, uint64_t op_addr, void *buf, size_t len);
+int client_write(struct client_pool *pool, uint64_t op_addr, const void *buf, size_t len);
+
+// multi-threaded demo workload, in client.c
+int run_pool_client(const struct net_config *cfg, const struct client_server *servers,
+                    int server_count, int threads, enum client_layout layout, bool replicate);
+// same-host latency of the shared memory path against the fabric, in client.c
+int run_local_bench(const struct net_config *cfg, const struct client_server *server);
+
+#endif
@@ -0,0 +1,80 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <rdma/fabric.h>
+
+#define DEFAULT_PORT 1701
+#define DEFAULT_PROVIDER "sockets"
+#define DEFAULT_ADDR "127.0.0.1"
+#define DEFAULT_IDLE_TIMEOUT 10
+
+// every CONFIG_ENV_PREFIX<KEY> variable overrides the config file, e.g. LIBFAB_TEST_PROVIDER
+#define CONFIG_ENV_PREFIX "LIBFAB_TEST_"
+#define CONFIG_FILE_ENV "LIBFAB_TEST_CONFIG"
+
+/*
+Fabric settings, applied in order from the defaults, the config file, the environment and the
+command line. The file holds "key = value" lines with # comments, keys are the field names.
+*/
+struct net_config
+{
+    char provider[32];
+    char addr[64];
+    unsigned short port;
+    // only FI_EP_MSG is supported, connections are set up through a passive endpoint
+    enum fi_ep_type ep_type;
+    // FI_MR_SCALABLE addresses registered memory by offset, FI_MR_BASIC by virtual address
+    enum fi_mr_mode mr_mode;
+    // command receives kept posted per connection, capped at MAX_RX_DEPTH
+    int rx_depth;
+    // 0 sizes them from rx_depth, the provider's transmit depth and MAX_CONNECTIONS
+    size_t cq_size;
+    size_t eq_size;
+    // seconds without a command before a server connection gives back its spare buffers, 0 never
+    int idle_timeout;
+    // carry PUT completions as RMA immediate data when the provider supports it. Without it,
+    // clients can use the smaller FI_CQ_FORMAT_CONTEXT completions
+    bool imm_data;
+    // clients send and check a CRC32C with every GET and PUT, servers always honour it
+    bool verify;
+    // clients compress GET and PUT data of at least this many bytes when the server agrees in the
+    // handshake, 0 never
+    size_t compress_min;
+    // servers write their store behind to this file and page it back in on restart, see
+    // persist.h. Empty keeps the store in memory only
+    char persist_path[256];
+    // servers map this file as their store instead of allocating one, sized to the file and
+    // shared with it. Clients address it by file offset, the pool's layouts still assume
+    // STORE_SIZE per server
+    char dataset_path[256];
+    // fault the whole dataset in when it's mapped rather than on first access
+    bool dataset_populate;
+    // ask for transparent huge pages on the mapping
+    bool dataset_hugepages;
+    // servers grant reads leases of this long on the blocks they fetch, which clients can serve
+    // from their read cache. Other clients' writes can go unseen for that long, 0 never
+    unsigned lease_ms;
+    // clients cache leased reads in this many bytes of registered memory, see read_cache.h.
+    // 0 never
+    size_t read_cache_size;
+    // servers queue commands of at most this many bytes ahead of bulk ones, see qos.h
+    size_t qos_small_max;
+    // servers start bulk commands only while fewer bytes than this are in flight, 0 no cap
+    size_t qos_bulk_bytes;
+    // clients ask for this share of a server's bulk bandwidth, relative to other clients
+    unsigned qos_weight;
+    // cycle accounting for callbacks and eq events, see prof.h
+    bool profile;
+};
+
+void config_defaults(struct net_config *cfg);
+int config_set(struct net_config *cfg, const char *key, const char *value);
+int config_load_file(struct net_config *cfg, const char *path);
+int config_load_env(struct net_config *cfg);
+// in config file format, so the output can be loaded back
+void config_print(const struct net_config *cfg, FILE *f);
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+CRC32C (Castagnoli) of buf, continuing from crc, pass 0 to start. Uses the SSE4.2 crc32
+instruction when the cpu has it, checked once at runtime, and a table driven version otherwise.
+*/
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// name of the implementation crc32c dispatches to
+const char *crc32c_impl(void);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef FAULT_H
+#define FAULT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+Fault injection for exercising the request state machine, see run_selftest. Every fault is off
+until set, and the hooks cost a branch on fault_enabled when none are.
+*/
+enum fault_type
+{
+    // a post fails with -FI_EAGAIN and waits on the pending list
+    FAULT_EAGAIN = 0,
+    // the rest of a cq read is held back until the next drain
+    FAULT_DELAY,
+    // a successful completion is reported as an error
+    FAULT_CQ_ERROR,
+    // a connection is shut down under a completion
+    FAULT_SHUTDOWN,
+    FAULT_TYPES
+};
+
+extern bool fault_enabled;
+
+// chance of type at each opportunity, in parts per million
+void fault_set(enum fault_type type, unsigned ppm);
+void fault_clear(void);
+// decisions come from a PRNG, the same seed and event order give the same faults
+void fault_seed(uint64_t seed);
+bool fault_hit(enum fault_type type);
+uint64_t fault_count(enum fault_type type);
+const char *fault_name(enum fault_type type);
+
+#endif
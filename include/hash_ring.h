@@ -0,0 +1,35 @@
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <stdint.h>
+
+// points per server on the ring, more points spread the load more evenly
+#define RING_VNODES 128
+
+struct ring_node
+{
+    uint64_t hash;
+    int server;
+};
+
+/*
+Consistent hash ring over a set of named servers. A server's points only depend on its name,
+so adding or removing one server only moves the keys between its points and their
+predecessors, about 1/n of the total.
+*/
+struct hash_ring
+{
+    struct ring_node *nodes;
+    int node_count;
+    int server_count;
+};
+
+int ring_init(struct hash_ring *ring, const char **names, int server_count, int vnodes);
+void ring_free(struct hash_ring *ring);
+
+// returns the server owning key, and in replica the next distinct server clockwise, -1 if none
+int ring_lookup(const struct hash_ring *ring, uint64_t key, int *replica);
+
+uint64_t ring_hash(uint64_t key);
+
+#endif
@@ -16,4 +16,16 @@
 
 #define FI_GOTO(label, call) GOTO(label, call "(): %s", fi_strerror((int)-(rc)))
 
+// per request chatter on stdout, compiled out of Release builds along with assert
+#ifdef NDEBUG
+#define TRACE(fmt, ...)                                                                            \
+    do                                                                                             \
+    {                                                                                              \
+        if (0)                                                                                     \
+            printf(fmt, ##__VA_ARGS__);                                                            \
+    } while (0)
+#else
+#define TRACE(fmt, ...) printf(fmt, ##__VA_ARGS__)
+#endif
+
 #endif
@@ -0,0 +1,27 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+A small LZ77 block codec in the style of LZ4: runs of literals followed by a match of at least
+4 bytes up to 64 KiB back, no entropy coding. Blocks are independent, the caller keeps track of
+the uncompressed length.
+*/
+
+// compressed output has to save at least 1/LZ_MIN_GAIN of the input to be worth sending
+#define LZ_MIN_GAIN 8
+
+static inline size_t lz_target(size_t len)
+{
+    return len - len / LZ_MIN_GAIN;
+}
+
+// returns the compressed size, or 0 if it doesn't fit in cap. Stops trying early on data that
+// doesn't compress, so passing lz_target(len) as cap makes incompressible blocks cheap to skip
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap);
+// returns the decompressed size, or -FI_EINVAL if src is corrupt or doesn't fit in cap
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif
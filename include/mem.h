@@ -4,10 +4,21 @@
 #include "network.h"
 #include <stdint.h>
 
+// active connections, each client connection also holds a bulk buffer, and so does each server
+// connection that agreed to FEATURE_LZ
 #define MAX_CONNECTIONS 16
 #define BULK_SIZE 4096
+// the working command plus the posted command receives
+#define CMD_BUFS_PER_CONNECTION (MAX_RX_DEPTH + 1)
+// an idle server connection keeps one posted receive and gives the rest back
+#define MAX_IDLE_CONNECTIONS 1024
+#define CMD_BUF_COUNT (MAX_CONNECTIONS * CMD_BUFS_PER_CONNECTION + MAX_IDLE_CONNECTIONS)
+
+// server only, the memory clients address with op_addr. A dataset store is the size of its file
+#define STORE_SIZE (64 * 1024 * 1024)
 
 int init_memory(struct net_info *ni);
+int init_store(struct net_info *ni, size_t size);
 
 void *alloc_bulk_buf();
 void *alloc_cmd_buf();
@@ -16,9 +27,32 @@ void free_bulk_buf(void *buf);
 void free_cmd_buf(void *buf);
 
 int close_memory(struct net_info *ni);
+void close_store(struct net_info *ni);
 
 struct fid_mr *get_bulk_mr();
 struct fid_mr *get_cmd_mr();
+struct fid_mr *get_store_mr();
+void *get_buf_desc(void *buf);
 
 uint64_t get_bulk_offset(void *bulk_vaddr);
+void *get_store_ptr(uint64_t offset, size_t len);
+// a dataset file we can't write, see the dataset_path config key
+bool is_store_read_only();
+
+// a leasing server's block versions, see CMD_FLAG_LEASE. Every write into the store is bracketed
+// by store_write_begin and store_write_end, store_version is 0 while one is landing in the block
+bool store_leases();
+void store_write_begin(uint64_t offset, size_t len);
+void store_write_end(uint64_t offset, size_t len);
+uint32_t store_version(uint64_t offset);
+
+// client only, registered memory for the read cache, see read_cache.h
+void *alloc_cache_mem(struct net_info *ni, size_t size);
+void free_cache_mem(void *buf);
+struct fid_mr *get_cache_mr();
+uint64_t get_cache_offset(void *cache_vaddr);
+
+// a same-host server's store, mapped read/write. NULL if it isn't shared
+void *open_shared_store(unsigned short port, size_t *size);
+void close_shared_store(void *store, size_t size);
 #endif
\ No newline at end of file
@@ -4,8 +4,15 @@
 #include <rdma/fi_rma.h>
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
+
+#include <sys/types.h>
+
+#include "config.h"
+#include "obj_pool.h"
 
 #define MAGIC 0x12345678
 struct network_handshake
@@ -13,37 +20,123 @@ struct network_handshake
     uint64_t magic;
     uint64_t bulk_key;
     uint64_t cmd_key;
+    // server only, zero from clients
+    uint64_t store_key;
+    // added to store offsets in RMA addresses, zero unless the domain uses FI_MR_BASIC
+    uint64_t store_addr;
+    // command receives kept posted, the initial send credits for the peer
+    uint64_t rx_depth;
+    // server only, set when the store is also mapped into shared memory, see open_shared_store.
+    // Clients with the same get_host_id() can skip the fabric entirely
+    uint64_t host_id;
+    // FEATURE_* bits. A client asks for what it wants to use, the server answers with what it
+    // agreed to for that connection
+    uint64_t features;
+    // server only, how long a client may serve a block read under FEATURE_LEASE from its cache
+    uint64_t lease_ms;
+    // client only, its connections' share of the server's bulk bandwidth, see qos.h. 0 counts
+    // as 1
+    uint64_t qos_weight;
 };
 
+// GET and PUT data may be compressed, see CMD_FLAG_LZ
+#define FEATURE_LZ 0x1
+// the client may use the store without commands, through native atomics and RMA on store_key.
+// A persisting or leasing server refuses, it has to see every access to page in and track writes
+#define FEATURE_DIRECT_STORE 0x2
+// server only, its store is a read only dataset. Commands that would store into it fail with
+// -FI_EACCES, and so would native atomics
+#define FEATURE_STORE_READ_ONLY 0x4
+// PUTs may ask for a lease on their block, see CMD_FLAG_LEASE. Needs lease_ms set in the server's
+// config, and its store then isn't shared with same-host clients
+#define FEATURE_LEASE 0x8
+// the peer handles the transport's own messages: it answers RECLAIM, so the server can take back
+// the credits for an idle connection's receives, see cmd_rx_shrink, and takes CREDITS
+#define FEATURE_RECLAIM 0x10
+
+// the unit a leasing server versions its store in
+#define LEASE_BLOCK 4096
+
+#define MAX_RX_DEPTH 8
+#define DEFAULT_RX_DEPTH 4
+
 struct net_info
 {
+    struct net_config cfg;
     struct fi_info *fi;
     struct fid_fabric *fabric;
     struct fid_wait *wait_set;
+    // readable while the wait set is signaled, -1 if the provider can't back it with an fd
+    int wait_fd;
     struct fid_eq *eq;
 
+    bool is_server;
+
     // server only
     struct fid_pep *pep;
+    // server only, one cq shared by every connection so idle ones don't each hold one
+    struct fid_cq *cq;
 
     struct connection *connection_list;
 
     struct fid_domain *domain;
 
     struct network_handshake local_keys;
+
+    // command receives posted per connection, capped at MAX_RX_DEPTH
+    int rx_depth;
+
+    // provider can carry immediate data with RMA writes (FI_REMOTE_CQ_DATA), and it's enabled
+    bool remote_cq_data;
+    // FI_CQ_FORMAT_DATA only where immediate data can arrive, a client using remote_cq_data
+    enum fi_cq_format cq_format;
+    size_t cq_size;
+    // provider supports native atomics (FI_ATOMIC), otherwise the server emulates them
+    bool atomics;
+    // queue posts until post_flush, otherwise every post goes out as soon as it's made
+    bool defer_posts;
+    // sends up to this size go out with FI_INJECT, the provider copies them at post time
+    size_t inject_size;
+
+    // completions held back by FAULT_DELAY, delivered first on the next drain
+    struct delayed_completion *delayed_head;
+    struct delayed_completion *delayed_tail;
 };
 
-struct connection
+#define POST_QUEUE_DEPTH 64
+
+enum post_op_type
 {
-    int client_id;
-    struct connection *next;
-    struct net_info *ni;
-    struct fid_ep *ep;
-    struct fid_cq *cq;
+    POST_RECV = 0,
+    POST_SEND,
+    POST_READ,
+    POST_WRITE,
+    // native atomics on the peer's store, buf is the registered network_cmd holding the operands
+    POST_FETCH_ADD,
+    POST_COMPARE_SWAP
+};
 
-    void *bulk_buf;
-    struct network_cmd *cmd_buf;
+// an operation waiting for the end of the progress iteration, holds copies of everything the
+// fi_*msg call points at
+struct post_op
+{
+    enum post_op_type type;
+    void *buf;
+    size_t len;
+    void *desc;
+    struct fi_rma_iov rma_iov;
+    uint64_t data;
+    uint64_t flags;
+    void *context;
 };
 
+struct post_queue
+{
+    int count;
+    struct post_op ops[POST_QUEUE_DEPTH];
+};
+
+// everything a completion touches, in half a cache line
 struct network_request
 {
     void (*callback)(struct network_request *rq);
@@ -51,41 +144,276 @@ struct network_request
     void *rq_data;
 
     int rq_res;
+    // completions still outstanding when one request drives several operations
+    int rq_pending;
 };
 
+// posts that couldn't go out yet, -FI_EAGAIN from the provider or no send credits
+struct pending_op;
+struct delayed_completion;
+
+// the fields every post and completion touch come first and fill the first cache line, see
+// setup_connection for the alignment
+struct connection
+{
+    struct net_info *ni;
+    struct fid_ep *ep;
+    struct network_cmd *cmd_buf;
+    void *bulk_buf;
+    struct network_request *recv_rq;
+    // request waiting on an RMA write with immediate data that doesn't consume a posted receive
+    struct network_request *imm_rq;
+
+    // receives the peer has posted for us, and receives we reposted since our last send
+    int send_credits;
+    int credits_to_return;
+    // received slots waiting for a request to call cmd_recv, oldest first
+    int rx_ready_count;
+    // 0, or the error that ended the connection, see connection_fail
+    int failed;
+
+    // data carried by the last immediate data completion, set before imm_rq's callback runs
+    uint64_t imm_data;
+    // posts that couldn't go out yet, retried in order on the next flush
+    struct pending_op *pending_head;
+    struct pending_op *pending_tail;
+    // requests whose post or receive failed, their callbacks run from post_flush
+    struct pending_op *failed_head;
+    struct pending_op *failed_tail;
+    int rx_depth;
+    // completions still queued on a shared cq for a closing connection are dropped
+    bool closing;
+    // down to one posted receive and no working command buffer, see cmd_rx_shrink
+    bool idle;
+    // server only, a RECLAIM is out and its answer will shrink the connection
+    bool reclaiming;
+    bool running_failed;
+
+    int client_id;
+    struct connection *next;
+    struct fid_cq *cq;
+
+    // keys the peer sent in the connect/accept handshake, magic is zero if it didn't
+    struct network_handshake remote_keys;
+
+    // command receives kept posted for the peer, a delivered message is swapped into cmd_buf
+    struct network_cmd *rx_bufs[MAX_RX_DEPTH];
+    struct network_request rx_rqs[MAX_RX_DEPTH];
+    int rx_ready[MAX_RX_DEPTH];
+
+    // server only, waits in cmd_recv for the client's next command
+    struct network_request cmd_rq;
+    time_t last_active;
+    // sends a RECLAIM, its answer or CREDITS from the spare cmd buffer in rq_data, NULL when none
+    // is out
+    struct network_request ctl_rq;
+
+    // server only, the working command's place in the scheduler, see qos.h
+    struct connection *qos_next;
+    // weighted fair queuing finish tag of the connection's latest bulk command
+    uint64_t qos_finish;
+    size_t qos_bytes;
+    bool qos_queued;
+    bool qos_bulk;
+    // its bytes count against the bulk cap
+    bool qos_inflight;
+
+    // posts are deferred here and flushed with FI_MORE at the end of each progress iteration
+    struct post_queue post_queue;
+} __attribute__((aligned(CACHE_LINE)));
+
 enum net_cmd_type
 {
     GET = 0,
-    PUT
+    PUT,
+    FETCH_ADD,
+    COMPARE_SWAP,
+    BATCH,
+    // handled by the transport and never delivered, see cmd_rx_shrink. reclaim holds the credits
+    // asked back, and the ones the answer gives up
+    RECLAIM,
+    RECLAIM_ACK,
+    // server only, just the credits field, see post_flush
+    CREDITS
+};
+
+#define MAX_BATCH 16
+
+// see qos.h
+enum cmd_priority
+{
+    // small or bulk by size
+    PRIO_DEFAULT = 0,
+    PRIO_LATENCY,
+    PRIO_BULK
 };
 
+// a range of the peer's registered memory as it goes over the wire, see cmd_rma_iov for the local
+// fi_rma_iov. No op moves more than BULK_SIZE
+struct cmd_iov
+{
+    uint64_t addr;
+    uint64_t key;
+    uint32_t len;
+} __attribute__((packed));
+
+static inline struct fi_rma_iov cmd_rma_iov(const struct cmd_iov *iov)
+{
+    return (struct fi_rma_iov){.addr = iov->addr, .len = iov->len, .key = iov->key};
+}
+
+// one GET or PUT inside a BATCH command, rma_iov is the range of the client buffer it covers
+struct network_batch_entry
+{
+    uint64_t op_addr;
+    struct cmd_iov rma_iov;
+    uint8_t type;
+} __attribute__((packed));
+
+// client can accept PUT completion as immediate data instead of a reply message
+#define CMD_FLAG_IMM 0x1
+// crc holds the CRC32C of the data. For GET the client sets it and the server checks it once the
+// data is in the store, for PUT the server fills it in from the store for the client to check,
+// carried as the immediate data when there's no reply. Not applied to BATCH entries
+#define CMD_FLAG_CRC 0x2
+// needs FEATURE_LZ, and the server's connection then holds a bulk buffer to stage the compressed
+// data in. For GET the client buffer holds lz_len bytes compressed with lz_compress, rma_iov.len
+// is still the size of the store range. For PUT the client accepts compressed data and the server
+// sets lz_len to its size, 0 if the range didn't compress. When the PUT completes with immediate
+// data, CMD_FLAG_CRC or CMD_FLAG_LZ make it lz_len << 32 | crc instead of op_addr. A compressed
+// PUT only does that if the provider carries 8 bytes of immediate data, otherwise it replies
+#define CMD_FLAG_LZ 0x4
+// PUT of one whole LEASE_BLOCK, needs FEATURE_LEASE. version holds the version of the client's
+// cached copy, 0 for none, and the server answers with the block's current version, only moving
+// the data if that differs. A 0 answer means a write to the block overlapped the read and the data
+// can't be cached. Always replied to, never compressed
+#define CMD_FLAG_LEASE 0x8
+
+/*
+The message itself, sent as far as the last used batch entry. It holds only what the peer needs,
+local fi_msg_rma setup is built from rma_iov where the op is posted. Every field is naturally
+aligned, so the atomic slots can be used in place, and the header is 48 bytes.
+*/
 struct network_cmd
 {
-    enum net_cmd_type type;
+    uint8_t type;
+    uint8_t flags;
+    // BATCH only, the entries past batch_count aren't sent
+    uint8_t batch_count;
+    // a cmd_priority, which of the server's queues the command waits in
+    uint8_t priority;
+    // receives the sender reposted since its last message, see struct connection
+    uint32_t credits;
+    int32_t status;
+    uint32_t crc;
     uint64_t op_addr;
 
-    struct fi_msg_rma rma;
-    struct fi_rma_iov rma_iov;
+    union
+    {
+        // GET and PUT
+        struct
+        {
+            struct cmd_iov rma_iov;
+            union
+            {
+                uint32_t lz_len;
+                // CMD_FLAG_LEASE, which can't be combined with CMD_FLAG_LZ
+                uint32_t version;
+            };
+        };
+        // FETCH_ADD and COMPARE_SWAP, the operands and result live in the registered cmd buffer
+        // so native atomics can use them directly, op_addr is the offset of the 64-bit target in
+        // the server bulk region
+        struct
+        {
+            uint64_t operand;
+            uint64_t compare;
+            uint64_t result;
+        };
+        uint32_t reclaim;
+    };
+
+    struct network_batch_entry batch[MAX_BATCH];
 };
 
-int init_network(struct net_info *ni, bool is_server);
+_Static_assert(offsetof(struct network_cmd, batch) == 48, "network_cmd header changed size");
+
+static inline size_t network_cmd_size(struct network_cmd *cmd)
+{
+    return offsetof(struct network_cmd, batch) +
+           cmd->batch_count * sizeof(struct network_batch_entry);
+}
+
+struct fi_info *get_fi(bool is_source, const struct net_config *cfg);
+uint64_t get_host_id(void);
+void free_fi(struct fi_info *info);
+
+// cfg is copied, a server listens on cfg->addr:cfg->port
+int init_network(struct net_info *ni, bool is_server, const struct net_config *cfg);
 void close_network(struct net_info *ni);
 
 int init_server(struct net_info *ni);
 int run_server(struct net_info *ni);
 void close_server(struct net_info *ni);
 
+/*
+For driving the server from an external epoll or io_uring loop instead of run_server. The loop
+watches server_wait_fd for readability, -1 when the provider has no fd, and on every turn calls
+server_progress then server_trywait. It may only block when that returns 0, -FI_EAGAIN means
+events arrived in between and it has to progress again. Blocking is bounded by
+server_wait_timeout, posts waiting on provider resources and idle connections don't raise the fd.
+*/
+int server_wait_fd(struct net_info *ni);
+void server_progress(struct net_info *ni);
+int server_trywait(struct net_info *ni);
+int server_wait_timeout(struct net_info *ni);
+pid_t fork_server(const struct net_config *cfg);
+struct client_pool;
+struct client_pool_attr;
+// a pool connected to the server fork_server started on cfg's port, retried while it starts
+// listening. NULL if it never answered
+struct client_pool *connect_forked_server(const struct net_config *cfg,
+                                          const struct client_pool_attr *attr);
+// SIGINT to a server from fork_server, then waits for it to exit
+void stop_forked_server(pid_t pid);
+
 int init_client(struct net_info *ni);
+int connect_to_server(struct net_info *ni, struct connection *cxn, const char *addr,
+                      unsigned short port);
 int run_client(struct net_info *ni, const char *addr, unsigned short port);
 void close_client(struct net_info *ni);
 
+int run_probe(const struct net_config *cfg, size_t len, const char *out_path);
+int run_selftest(const struct net_config *cfg);
+
+int open_cq(struct net_info *ni, size_t size, struct fid_cq **cq);
 int setup_connection(struct net_info *ni, struct connection **cxn_ptr, struct fi_info *info);
+void close_connection(struct connection *cxn);
+
+int cmd_rx_init(struct connection *cxn, int depth);
+void cmd_rx_close(struct connection *cxn);
+// starts taking an idle connection's receives back, false if the peer can't be asked
+bool cmd_rx_shrink(struct connection *cxn);
 
 void cmd_recv(struct network_request *rq);
 void cmd_send(struct network_request *rq);
+void cmd_send_untracked(struct connection *cxn);
+
+void bulk_op(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len, bool is_read,
+             uint64_t flags);
+void bulk_read(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len);
+void bulk_write(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len);
+void bulk_write_imm(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len,
+                    uint64_t data);
+
+void remote_fetch_add(struct network_request *rq);
+void remote_compare_swap(struct network_request *rq);
+
+void post_flush(struct connection *cxn);
+void post_flush_all(struct net_info *ni);
 
-void bulk_read(struct network_request *rq, struct fi_msg_rma *msg);
-void bulk_write(struct network_request *rq, struct fi_msg_rma *msg);
+void connection_fail(struct connection *cxn, int err);
+void delayed_forget(struct net_info *ni, struct connection *cxn);
 
 void process_all_cq_events(struct net_info *ni);
 void process_cq_events(struct connection *cxn);
@@ -0,0 +1,34 @@
+#ifndef OBJ_POOL_H
+#define OBJ_POOL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define CACHE_LINE 64
+
+struct obj_cache;
+
+/*
+Fixed size objects kept on per-thread free lists, so the datapath stops calling malloc once the
+lists are warm. An object may be freed on any thread, it goes back to the list of the thread that
+allocated it. A thread's list outlives the thread and is adopted by the next one to allocate.
+Objects are CACHE_LINE aligned and never given back to the system.
+*/
+struct obj_pool
+{
+    size_t size;
+    pthread_mutex_t lock;
+    bool key_ready;
+    pthread_key_t key;
+    // lists of exited threads, waiting for a new owner
+    struct obj_cache *orphans;
+};
+
+#define OBJ_POOL_INIT(type) {.size = sizeof(type), .lock = PTHREAD_MUTEX_INITIALIZER}
+
+// contents are undefined, like malloc
+void *obj_alloc(struct obj_pool *pool);
+void obj_free(struct obj_pool *pool, void *obj);
+
+#endif
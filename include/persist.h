@@ -0,0 +1,44 @@
+#ifndef PERSIST_H
+#define PERSIST_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+Write-behind persistence of the server store to a local file, set with the persist_path config
+key. Stores into the store only mark their pages dirty, the server's progress loop writes dirty
+pages out in batches through io_uring with O_DIRECT, so no command waits on the disk for a write.
+Pages already in the file when the server starts are read back the first time a command touches
+them. The file is the store's image, page for page.
+*/
+
+// the unit of dirty tracking and of every read and write, O_DIRECT needs it aligned
+#define PERSIST_PAGE 4096
+// reads and writes in flight
+#define PERSIST_QUEUE_DEPTH 64
+// adjacent dirty pages go out as one write of up to this many pages
+#define PERSIST_MAX_RUN 64
+// dirty pages wait this long, so repeated stores to a page cost one write
+#define PERSIST_FLUSH_MS 10
+// unless this many are waiting
+#define PERSIST_HIGH_WATER 1024
+// persist_close gives up on pages still dirty after this many passes in a row where writes
+// failed and none succeeded
+#define PERSIST_CLOSE_PASSES 8
+
+// store must be PERSIST_PAGE aligned and size a multiple of it
+int persist_open(const char *path, void *store, size_t size);
+// writes out everything dirty and syncs the file, logging the pages it couldn't write
+void persist_close(void);
+bool persist_enabled(void);
+
+// reads any page of the range that is still only in the file, blocking
+int persist_fault_in(uint64_t offset, size_t len);
+void persist_dirty(uint64_t offset, size_t len);
+// reaps finished writes and starts new ones, never blocks
+void persist_progress(void);
+// dirty pages or writes in flight, the server polls until there are none
+bool persist_busy(void);
+
+#endif
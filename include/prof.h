@@ -0,0 +1,61 @@
+#ifndef PROF_H
+#define PROF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+/*
+Cycle accounting for request callbacks and EQ events, set with the profile config key. Each
+dispatch is timed with the cycle counter and charged to the callback's address, or the event
+type, in a table per thread, both inclusive and without the dispatches nested inside it. The
+hooks cost a branch on prof_enabled when it's off.
+
+prof_dump prints every thread's tables, the server does it on SIGUSR1 and when it exits.
+Callbacks are named from the dynamic symbol table where they're exported, static ones by their
+offset in the executable for addr2line.
+*/
+
+extern bool prof_enabled;
+
+// the dispatch being timed, and the cycles of the ones nested inside it so far
+struct prof_frame
+{
+    uint64_t start;
+    uint64_t saved_child;
+};
+
+static inline uint64_t prof_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64_t cnt;
+
+    __asm__ volatile("mrs %0, cntvct_el0" : "=r"(cnt));
+    return cnt;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+void prof_enable(void);
+
+void prof_begin(struct prof_frame *frame);
+void prof_end_callback(struct prof_frame *frame, void *callback);
+void prof_end_eq(struct prof_frame *frame, uint32_t event);
+
+void prof_dump(FILE *f);
+// async signal safe, the next prof_poll dumps to stderr
+void prof_request_dump(void);
+void prof_poll(void);
+
+#endif
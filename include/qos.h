@@ -0,0 +1,35 @@
+#ifndef QOS_H
+#define QOS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mem.h"
+#include "network.h"
+
+/*
+Server side scheduling of the commands that move data. A GET, PUT or BATCH is checked as it
+arrives and then queued, and server_progress starts queued commands once the cq is drained, so
+everything that arrived together competes.
+
+Small commands go first, in arrival order. Bulk ones are ordered by weighted fair queuing over
+their bytes, each connection weighted by the qos_weight its client sent in the handshake, and only
+start while the bulk bytes in flight stay under the qos_bulk_bytes config key. One is always let
+through when none is in flight. The class comes from the command's priority, PRIO_DEFAULT ones up
+to qos_small_max bytes are small. A connection runs one command at a time, so each queue holds at
+most one per connection.
+*/
+
+#define QOS_DEFAULT_SMALL_MAX 1024
+#define QOS_DEFAULT_BULK_BYTES (16 * BULK_SIZE)
+
+// rq's working command starts with rq->callback when its turn comes
+void qos_submit(struct network_request *rq, size_t bytes);
+// starts every queued command whose turn it is, true if any did
+bool qos_dispatch(struct net_info *ni);
+// the connection's command has finished moving data, its bytes stop counting against the cap
+void qos_done(struct connection *cxn);
+// drops whatever the connection has queued or in flight, before it's freed
+void qos_forget(struct connection *cxn);
+
+#endif
@@ -0,0 +1,45 @@
+#ifndef READ_CACHE_H
+#define READ_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "network.h"
+
+/*
+Client side cache of LEASE_BLOCK blocks of the pool's address space, set with the read_cache_size
+config key. Slots live in registered memory, so a miss is filled by the server writing the whole
+block straight into its slot with a CMD_FLAG_LEASE PUT. A filled block is served locally until
+the server's lease on it runs out, after that the next read revalidates it by version and the
+server only sends the data again if the block changed.
+
+Writes through the same pool drop the blocks they touch once they complete, writes by other
+clients can go unseen for up to the lease. Blocks being filled are never evicted, replacement
+among the rest is CLOCK. Every call is thread safe.
+*/
+struct read_cache;
+
+struct read_cache *read_cache_open(struct net_info *ni, size_t size);
+void read_cache_close(struct read_cache *cache);
+
+// copies [addr, addr + len) into buf and returns true if every block it touches is cached and
+// still leased
+bool read_cache_read(struct read_cache *cache, uint64_t addr, void *buf, size_t len);
+// drops every block overlapping the range, fills of them in flight aren't kept
+void read_cache_invalidate(struct read_cache *cache, uint64_t addr, size_t len);
+
+// a slot to fill the block at block_addr into, and the version to send with the fill, 0 unless
+// an expired copy is being revalidated. -1 if the block is already being filled or every slot is
+int read_cache_reserve(struct read_cache *cache, uint64_t block_addr, uint64_t lease_ms,
+                       uint32_t *version);
+// where the server writes the block, as the rma_iov of the fill
+void *read_cache_slot(struct read_cache *cache, int slot);
+uint64_t read_cache_key(struct read_cache *cache);
+uint64_t read_cache_slot_addr(struct read_cache *cache, int slot);
+// ends a fill with its status and the version the server answered. On success copies len bytes
+// at off within the block into buf, and keeps the block if it's still wanted
+void read_cache_fill_done(struct read_cache *cache, int slot, int status, uint32_t version,
+                          size_t off, void *buf, size_t len);
+
+#endif
@@ -1,7 +1,9 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <arpa/inet.h>
@@ -14,6 +16,9 @@
 #include <rdma/fi_endpoint.h>
 #include <rdma/fi_rma.h>
 
+#include "client_pool.h"
+#include "crc32c.h"
+#include "hash_ring.h"
 #include "log.h"
 #include "mem.h"
 #include "network.h"
@@ -23,11 +28,16 @@ int init_client(struct net_info *ni)
     return setup_connection(ni, NULL, ni->fi);
 }
 
-int connect_to_server(struct net_info *ni, const char *addr, unsigned short port)
+int connect_to_server(struct net_info *ni, struct connection *cxn, const char *addr,
+                      unsigned short port)
 {
     uint32_t event = 0;
 
-    struct fi_eq_cm_entry cm_entry;
+    struct
+    {
+        struct fi_eq_cm_entry cm_entry;
+        struct network_handshake keys;
+    } entry;
     struct sockaddr_in sin;
     int rc;
 
@@ -35,7 +45,7 @@ int connect_to_server(struct net_info *ni, const char *addr, unsigned short port
     sin.sin_port = htons(port);
     inet_pton(AF_INET, addr, &(sin.sin_addr));
 
-    rc = fi_connect(ni->connection_list->ep, &sin, NULL, 0);
+    rc = fi_connect(cxn->ep, &sin, &ni->local_keys, sizeof(ni->local_keys));
     printf("fi_connect(%s:%d) = %d\n", addr, port, rc);
     if (rc != 0)
     {
@@ -43,7 +53,7 @@ int connect_to_server(struct net_info *ni, const char *addr, unsigned short port
         return rc;
     }
 
-    // wait for connect event
+    // wait for connect event, the eq is shared so skip anything meant for another endpoint
     do
     {
         rc = fi_wait(ni->wait_set, 1000);
@@ -52,7 +62,7 @@ int connect_to_server(struct net_info *ni, const char *addr, unsigned short port
             FI_GOTO(done, "fi_wait");
         }
 
-        rc = fi_eq_read(ni->eq, &event, &cm_entry, sizeof(cm_entry), 0);
+        rc = fi_eq_read(ni->eq, &event, &entry, sizeof(entry), 0);
         if (rc == -FI_EAGAIN)
         {
             fprintf(stderr, "timeout waiting for event\n");
@@ -62,9 +72,40 @@ int connect_to_server(struct net_info *ni, const char *addr, unsigned short port
             fprintf(stderr, "fi_eq_read rc=%d\n", rc);
             return rc;
         }
+        else if (entry.cm_entry.fid != &cxn->ep->fid)
+        {
+            fprintf(stderr, "ignoring event %d for another endpoint\n", event);
+            rc = -FI_EAGAIN;
+        }
     } while (rc == -FI_EAGAIN);
     fprintf(stderr, "got event: %d - %s\n", event, fi_tostr(&event, FI_TYPE_EQ_EVENT));
 
+    if (event != FI_CONNECTED)
+    {
+        return -FI_ECONNREFUSED;
+    }
+
+    if (rc == sizeof(entry) && entry.keys.magic == MAGIC)
+    {
+        cxn->remote_keys = entry.keys;
+        cxn->send_credits = entry.keys.rx_depth;
+
+        if (ni->atomics && (!(entry.keys.features & FEATURE_DIRECT_STORE) ||
+                            (entry.keys.features & FEATURE_STORE_READ_ONLY)))
+        {
+            fprintf(stderr, "server store not directly writable, using emulated atomics\n");
+            ni->atomics = false;
+        }
+    }
+    else
+    {
+        fprintf(stderr, "no keys from server, falling back to emulated atomics\n");
+        ni->atomics = false;
+        cxn->send_credits = 1;
+    }
+
+    rc = 0;
+
 done:
     return rc;
 }
@@ -73,6 +114,10 @@ int addr = 0x4000;
 int get_next_addr()
 {
     addr += BULK_SIZE;
+    if (addr + BULK_SIZE > STORE_SIZE)
+    {
+        addr = 0x4000;
+    }
 
     return addr;
 }
@@ -85,31 +130,73 @@ int get_next_len()
     return len;
 }
 
+#define CMD_LIMIT 10
+
 int cmd_count = 0;
+bool cmds_done = false;
 void do_cmd(struct network_request *cmd_rq, enum net_cmd_type type);
 
 void do_put(struct network_request *cmd_rq)
 {
-    printf("do_put()\n");
+    TRACE("do_put()\n");
     do_cmd(cmd_rq, PUT);
 }
 
 void do_get(struct network_request *cmd_rq)
 {
-    printf("do_get()\n");
+    TRACE("do_get()\n");
     sprintf(cmd_rq->cxn->bulk_buf, "This is client speaking, cmd_count = %d\n", cmd_count);
     do_cmd(cmd_rq, GET);
 }
 
+// the demo stops at the first failed request
+static bool demo_failed(struct network_request *rq)
+{
+    if (!rq->rq_res)
+    {
+        return false;
+    }
+
+    fprintf(stderr, "request failed: %s\n", fi_strerror(-rq->rq_res));
+    cmds_done = true;
+
+    return true;
+}
+
 void print_put(struct network_request *rq)
 {
-    printf("received PUT from server: %s\n", rq->cxn->bulk_buf);
+    struct connection *cxn = rq->cxn;
+    // do_cmd waits for the immediate data instead of a reply whenever the provider has it
+    uint32_t crc = cxn->ni->remote_cq_data ? cxn->imm_data : cxn->cmd_buf->crc;
+
+    if (demo_failed(rq))
+    {
+        return;
+    }
+
+    TRACE("received PUT from server: %s\n", (char *)rq->cxn->bulk_buf);
+
+    if (cxn->ni->cfg.verify && crc32c(0, cxn->bulk_buf, BULK_SIZE) != crc)
+    {
+        fprintf(stderr, "crc mismatch on PUT from %llx\n", (unsigned long long)addr);
+    }
+
+    if (cmd_count >= CMD_LIMIT)
+    {
+        cmds_done = true;
+        return;
+    }
 
     do_get(rq);
 }
 
 void wait_for_complete(struct network_request *rq)
 {
+    if (demo_failed(rq))
+    {
+        return;
+    }
+
     if (rq->cxn->cmd_buf->type == PUT)
     {
         rq->callback = print_put;
@@ -129,8 +216,36 @@ void do_cmd(struct network_request *cmd_rq, enum net_cmd_type type)
     struct network_cmd *cmd = cmd_rq->cxn->cmd_buf;
     cmd->type = type;
 
-    // op_addr doesn't actually do anything here, just dummy data
-    cmd->op_addr = get_next_addr();
+    // set up rma, cmd_buf changes as replies are swapped in so this is done for every command
+    cmd->rma_iov.addr = get_bulk_offset(cmd_rq->cxn->bulk_buf);
+    cmd->rma_iov.len = BULK_SIZE;
+    cmd->rma_iov.key = fi_mr_key(get_bulk_mr());
+
+    // each PUT reads back what the GET before it stored
+    cmd->op_addr = type == PUT ? addr : get_next_addr();
+    cmd->flags = 0;
+    cmd->batch_count = 0;
+    cmd->priority = PRIO_DEFAULT;
+
+    if (cmd_rq->cxn->ni->cfg.verify)
+    {
+        cmd->flags |= CMD_FLAG_CRC;
+        cmd->crc = type == GET ? crc32c(0, cmd_rq->cxn->bulk_buf, BULK_SIZE) : 0;
+    }
+
+    if (type == PUT && cmd_rq->cxn->ni->remote_cq_data)
+    {
+        // completion arrives as immediate data on the RMA write, so be ready for it before the
+        // command goes out
+        cmd->flags |= CMD_FLAG_IMM;
+        cmd_rq->callback = print_put;
+        cmd_rq->cxn->imm_rq = cmd_rq;
+
+        cmd_send_untracked(cmd_rq->cxn);
+        cmd_count++;
+
+        return;
+    }
 
     cmd_send(cmd_rq);
     cmd_count++;
@@ -141,45 +256,322 @@ int initial_request(struct network_request *cmd_rq)
     do_get(cmd_rq);
 }
 
-int run_client(struct net_info *ni, const char *addr, unsigned short port)
+// atomics benchmark, alternating fetch-add and compare-swap on one counter in the server store
+#define ATOMIC_ITERS 1000
+#define ATOMIC_COUNTER_ADDR 0
+
+int atomic_count = 0;
+uint64_t atomic_ns[2];
+uint64_t atomic_ops[2];
+uint64_t atomic_expected = 0;
+struct timespec atomic_start;
+
+static uint64_t elapsed_ns(struct timespec *start)
 {
-    struct network_request cmd_rq;
+    struct timespec now;
 
-    connect_to_server(ni, addr, port);
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-    cmd_rq.cxn = ni->connection_list;
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL + now.tv_nsec - start->tv_nsec;
+}
 
-    ni->connection_list->bulk_buf = alloc_bulk_buf();
-    ni->connection_list->cmd_buf = alloc_cmd_buf();
+void do_atomic(struct network_request *rq);
 
-    struct network_cmd *cmd = cmd_rq.cxn->cmd_buf;
+void atomic_complete(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    int idx = cmd->type == FETCH_ADD ? 0 : 1;
 
-    // set up rma
-    cmd->rma_iov.addr = get_bulk_offset(cmd_rq.cxn->bulk_buf);
-    cmd->rma_iov.len = BULK_SIZE;
-    cmd->rma_iov.key = fi_mr_key(get_bulk_mr());
+    atomic_ns[idx] += elapsed_ns(&atomic_start);
+    atomic_ops[idx]++;
+
+    if (cmd->status != 0 || rq->rq_res != 0)
+    {
+        fprintf(stderr, "atomic failed: status %d res %d\n", cmd->status, rq->rq_res);
+    }
+    else if (atomic_count > 0 && cmd->result != atomic_expected)
+    {
+        fprintf(stderr, "atomic %d: got %llu, expected %llu\n", cmd->type,
+                (unsigned long long)cmd->result, (unsigned long long)atomic_expected);
+    }
 
-    cmd->rma.rma_iov_count = 1;
+    // both ops leave the counter one higher
+    atomic_expected = cmd->result + 1;
+    atomic_count++;
 
-    initial_request(&cmd_rq);
+    if (atomic_count < ATOMIC_ITERS)
+    {
+        do_atomic(rq);
+    }
+}
+
+void wait_for_atomic(struct network_request *rq)
+{
+    rq->callback = atomic_complete;
+    cmd_recv(rq);
+}
+
+void do_atomic(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+
+    cmd->type = atomic_count % 2 ? COMPARE_SWAP : FETCH_ADD;
+    cmd->flags = 0;
+    cmd->op_addr = ATOMIC_COUNTER_ADDR;
+    cmd->status = 0;
+    cmd->batch_count = 0;
+    cmd->priority = PRIO_DEFAULT;
+    cmd->compare = atomic_expected;
+    cmd->operand = cmd->type == FETCH_ADD ? 1 : atomic_expected + 1;
+    rq->rq_res = 0;
 
-    while (cmd_count < 10)
+    clock_gettime(CLOCK_MONOTONIC, &atomic_start);
+
+    if (rq->cxn->ni->atomics)
     {
-        int rc = fi_wait(ni->wait_set, 1000);
-        if (rc == -FI_ETIMEDOUT)
+        rq->callback = atomic_complete;
+        if (cmd->type == FETCH_ADD)
         {
-            printf("wait timeout\n");
-            continue;
+            remote_fetch_add(rq);
         }
-        else if (rc < 0)
+        else
         {
-            fprintf(stderr, "Error waiting: %d\n", rc);
-            continue;
+            remote_compare_swap(rq);
         }
+    }
+    else
+    {
+        rq->callback = wait_for_atomic;
+        cmd_send(rq);
+    }
+}
+
+// batch benchmark, MAX_BATCH small GET/PUTs per command sharing the client bulk buffer
+#define BATCH_ITERS 100
+#define BATCH_OP_LEN (BULK_SIZE / MAX_BATCH)
+
+int batches_done = 0;
+
+void do_batch(struct network_request *rq);
+
+void batch_complete(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+
+    if (cmd->status != 0)
+    {
+        fprintf(stderr, "batch failed: %d\n", cmd->status);
+    }
+
+    batches_done++;
+    if (batches_done < BATCH_ITERS)
+    {
+        do_batch(rq);
+    }
+}
+
+void wait_for_batch(struct network_request *rq)
+{
+    rq->callback = batch_complete;
+    cmd_recv(rq);
+}
+
+void do_batch(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    uint64_t base = get_bulk_offset(rq->cxn->bulk_buf);
+
+    cmd->type = BATCH;
+    cmd->flags = 0;
+    cmd->status = 0;
+    cmd->batch_count = MAX_BATCH;
+    cmd->priority = PRIO_DEFAULT;
+
+    for (int i = 0; i < MAX_BATCH; i++)
+    {
+        struct network_batch_entry *entry = &cmd->batch[i];
+
+        entry->type = i % 2 ? PUT : GET;
+        entry->op_addr = get_next_addr();
+        entry->rma_iov.addr = base + i * BATCH_OP_LEN;
+        entry->rma_iov.len = BATCH_OP_LEN;
+        entry->rma_iov.key = fi_mr_key(get_bulk_mr());
+    }
+
+    rq->callback = wait_for_batch;
+    cmd_send(rq);
+}
+
+static void client_progress(struct net_info *ni)
+{
+    int rc;
+
+    // anything queued outside of a completion callback, e.g. the first request of a phase
+    post_flush_all(ni);
+
+    rc = fi_wait(ni->wait_set, 1000);
+    if (rc == -FI_ETIMEDOUT)
+    {
+        printf("wait timeout\n");
+        return;
+    }
+    else if (rc < 0)
+    {
+        fprintf(stderr, "Error waiting: %d\n", rc);
+        return;
+    }
+
+    TRACE("got event\n");
+    process_cq_events(ni->connection_list);
+}
+
+void run_batch_bench(struct net_info *ni, struct network_request *cmd_rq)
+{
+    struct timespec start;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    batches_done = 0;
+    do_batch(cmd_rq);
+
+    while (batches_done < BATCH_ITERS)
+    {
+        client_progress(ni);
+    }
+
+    ns = elapsed_ns(&start);
+    printf("batched: %d ops in %d messages, %.2f us/op, %.0f ops/s\n", BATCH_ITERS * MAX_BATCH,
+           BATCH_ITERS, ns / 1000.0 / (BATCH_ITERS * MAX_BATCH),
+           BATCH_ITERS * MAX_BATCH * 1e9 / ns);
+}
+
+// queue depth benchmark, QD_DEPTH one-sided reads of the server store kept in flight so each
+// progress iteration reposts many ops at once
+#define QD_DEPTH 32
+#define QD_OPS 10000
+#define QD_OP_LEN 64
+
+struct network_request qd_rqs[QD_DEPTH];
+int qd_issued = 0;
+int qd_done = 0;
+
+void qd_issue(struct network_request *rq)
+{
+    int slot = rq - qd_rqs;
+    struct fi_rma_iov rma_iov = {
+        .addr = rq->cxn->remote_keys.store_addr + slot * QD_OP_LEN,
+        .len = QD_OP_LEN,
+        .key = rq->cxn->remote_keys.store_key,
+    };
+    struct fi_msg_rma msg = {
+        .rma_iov = &rma_iov,
+        .rma_iov_count = 1,
+    };
+
+    bulk_op(rq, &msg, (char *)rq->cxn->bulk_buf + slot * QD_OP_LEN, QD_OP_LEN, 1, 0);
+    qd_issued++;
+}
+
+void qd_complete(struct network_request *rq)
+{
+    qd_done++;
+    if (qd_issued < QD_OPS)
+    {
+        qd_issue(rq);
+    }
+}
+
+void run_qd_bench(struct net_info *ni, struct connection *cxn, bool defer)
+{
+    struct timespec start;
+    uint64_t ns;
+
+    if (cxn->remote_keys.magic != MAGIC)
+    {
+        printf("queue depth %d: skipped, no server keys\n", QD_DEPTH);
+        return;
+    }
+
+    if (!(cxn->remote_keys.features & FEATURE_DIRECT_STORE))
+    {
+        printf("queue depth %d: skipped, server store not directly accessible\n", QD_DEPTH);
+        return;
+    }
+
+    ni->defer_posts = defer;
+    qd_issued = 0;
+    qd_done = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < QD_DEPTH; i++)
+    {
+        qd_rqs[i] = (struct network_request){.callback = qd_complete, .cxn = cxn};
+        qd_issue(&qd_rqs[i]);
+    }
+
+    while (qd_done < QD_OPS)
+    {
+        client_progress(ni);
+    }
+
+    ns = elapsed_ns(&start);
+    printf("queue depth %d, %s posts: %.0f ops/s\n", QD_DEPTH, defer ? "deferred" : "immediate",
+           QD_OPS * 1e9 / ns);
+
+    ni->defer_posts = true;
+}
+
+void run_atomic_bench(struct net_info *ni, struct network_request *cmd_rq)
+{
+    // the counter may have been left non-zero by an earlier client, the first fetch-add tells us
+    // where it starts
+    atomic_count = 0;
+    atomic_expected = 0;
+    do_atomic(cmd_rq);
 
-        printf("got event\n");
-        process_cq_events(ni->connection_list);
+    while (atomic_count < ATOMIC_ITERS)
+    {
+        client_progress(ni);
     }
+
+    printf("atomics (%s): fetch-add %.2f us, compare-swap %.2f us avg over %d ops\n",
+           ni->atomics ? "native" : "emulated",
+           atomic_ops[0] ? atomic_ns[0] / 1000.0 / atomic_ops[0] : 0.0,
+           atomic_ops[1] ? atomic_ns[1] / 1000.0 / atomic_ops[1] : 0.0, ATOMIC_ITERS);
+}
+
+int run_client(struct net_info *ni, const char *addr, unsigned short port)
+{
+    struct network_request cmd_rq;
+
+    connect_to_server(ni, ni->connection_list, addr, port);
+
+    cmd_rq.cxn = ni->connection_list;
+
+    ni->connection_list->bulk_buf = alloc_bulk_buf();
+    ni->connection_list->cmd_buf = alloc_cmd_buf();
+
+    struct timespec start;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    initial_request(&cmd_rq);
+
+    while (!cmds_done)
+    {
+        client_progress(ni);
+    }
+
+    ns = elapsed_ns(&start);
+    printf("unbatched: %d ops, %.2f us/op, %.0f ops/s\n", cmd_count, ns / 1000.0 / cmd_count,
+           cmd_count * 1e9 / ns);
+
+    run_batch_bench(ni, &cmd_rq);
+    run_qd_bench(ni, cmd_rq.cxn, false);
+    run_qd_bench(ni, cmd_rq.cxn, true);
+    run_atomic_bench(ni, &cmd_rq);
 }
 
 void close_client(struct net_info *ni)
@@ -187,8 +579,344 @@ void close_client(struct net_info *ni)
     fi_close((fid_t)ni->connection_list->cq);
     fi_close((fid_t)ni->connection_list->ep);
 
+    cmd_rx_close(ni->connection_list);
+
     free_cmd_buf(ni->connection_list->cmd_buf);
 
     free_bulk_buf(ni->connection_list->bulk_buf);
     free(ni->connection_list);
-}
\ No newline at end of file
+}
+
+// pool workload, every thread writes and reads back its own range with the blocking calls
+#define POOL_ITERS 100
+#define POOL_OP_LEN 10000
+#define POOL_BASE_ADDR 0x100000
+
+// one large op at a time, striped over every connection in the pool
+#define STRIPE_ITERS 20
+#define STRIPE_OP_LEN (1024 * 1024)
+// compress_min for the compressed stripe pass, unless the config sets one
+#define BENCH_COMPRESS_MIN 1024
+#define STRIPE_BASE_ADDR 0x800000
+
+struct pool_worker
+{
+    struct client_pool *pool;
+    int id;
+    int errors;
+    pthread_t thread;
+};
+
+static void *pool_worker_thread(void *arg)
+{
+    struct pool_worker *w = arg;
+    uint64_t op_addr = POOL_BASE_ADDR + (uint64_t)w->id * 2 * POOL_OP_LEN;
+    char *out = malloc(POOL_OP_LEN);
+    char *in = malloc(POOL_OP_LEN);
+
+    for (int i = 0; i < POOL_ITERS; i++)
+    {
+        int rc;
+
+        memset(out, 'a' + (w->id + i) % 26, POOL_OP_LEN);
+        snprintf(out, POOL_OP_LEN, "worker %d iteration %d", w->id, i);
+
+        rc = client_write(w->pool, op_addr, out, POOL_OP_LEN);
+        if (rc == 0)
+        {
+            rc = client_read(w->pool, op_addr, in, POOL_OP_LEN);
+        }
+
+        if (rc != 0 || memcmp(in, out, POOL_OP_LEN))
+        {
+            fprintf(stderr, "worker %d iteration %d: rc %d, data %s\n", w->id, i, rc,
+                    rc ? "-" : "mismatch");
+            w->errors++;
+        }
+    }
+
+    free(out);
+    free(in);
+
+    return NULL;
+}
+
+static int run_stripe_bench(struct client_pool *pool, int cxn_count, const char *name)
+{
+    char *out = malloc(STRIPE_OP_LEN);
+    char *in = malloc(STRIPE_OP_LEN);
+    struct timespec start;
+    uint64_t write_ns = 0;
+    uint64_t read_ns = 0;
+    int errors = 0;
+
+    for (int i = 0; i < STRIPE_ITERS; i++)
+    {
+        int rc;
+
+        // every other stripe is noise, so compression has blocks to skip as well as to shrink
+        for (int j = 0; j < STRIPE_OP_LEN; j++)
+        {
+            out[j] = (j / BULK_SIZE) % 2 ? rand() : i + j / BULK_SIZE;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        rc = client_write(pool, STRIPE_BASE_ADDR, out, STRIPE_OP_LEN);
+        write_ns += elapsed_ns(&start);
+
+        if (rc == 0)
+        {
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            rc = client_read(pool, STRIPE_BASE_ADDR, in, STRIPE_OP_LEN);
+            read_ns += elapsed_ns(&start);
+        }
+
+        if (rc != 0 || memcmp(in, out, STRIPE_OP_LEN))
+        {
+            fprintf(stderr, "stripe iteration %d: rc %d, data %s\n", i, rc,
+                    rc ? "-" : "mismatch");
+            errors++;
+        }
+    }
+
+    printf("stripe %s: %d connections, %d byte ops, write %.1f MB/s, read %.1f MB/s, %d errors\n",
+           name, cxn_count, STRIPE_OP_LEN, STRIPE_ITERS * (double)STRIPE_OP_LEN * 1e3 / write_ns,
+           STRIPE_ITERS * (double)STRIPE_OP_LEN * 1e3 / read_ns, errors);
+
+    free(out);
+    free(in);
+
+    return errors;
+}
+
+// same-host latency, the shared memory path against the configured provider over loopback
+#define LOCAL_ITERS 10000
+#define LOCAL_SMALL_LEN 64
+
+static void run_local_pass(struct client_pool *pool, const char *name)
+{
+    char small[LOCAL_SMALL_LEN] = {0};
+    char *large = calloc(1, STRIPE_OP_LEN);
+    struct timespec start;
+    uint64_t read_ns, write_ns, large_ns;
+    int errors = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOCAL_ITERS; i++)
+    {
+        errors += client_write(pool, STRIPE_BASE_ADDR, small, sizeof(small)) != 0;
+    }
+    write_ns = elapsed_ns(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < LOCAL_ITERS; i++)
+    {
+        errors += client_read(pool, STRIPE_BASE_ADDR, small, sizeof(small)) != 0;
+    }
+    read_ns = elapsed_ns(&start);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < STRIPE_ITERS; i++)
+    {
+        errors += client_read(pool, STRIPE_BASE_ADDR, large, STRIPE_OP_LEN) != 0;
+    }
+    large_ns = elapsed_ns(&start);
+
+    printf("%s: %d byte write %.2f us, read %.2f us, %d byte read %.1f MB/s, %d errors\n", name,
+           LOCAL_SMALL_LEN, write_ns / 1000.0 / LOCAL_ITERS, read_ns / 1000.0 / LOCAL_ITERS,
+           STRIPE_OP_LEN, STRIPE_ITERS * (double)STRIPE_OP_LEN * 1e3 / large_ns, errors);
+
+    free(large);
+}
+
+int run_local_bench(const struct net_config *cfg, const struct client_server *server)
+{
+    struct client_pool_attr attr = {
+        .cxns_per_server = 1,
+        .layout = LAYOUT_CONTIGUOUS,
+        .net = cfg,
+    };
+    char name[64];
+
+    for (int local = 0; local < 2; local++)
+    {
+        struct client_pool *pool;
+
+        attr.no_local_path = !local;
+        pool = client_pool_open(server, 1, &attr);
+        if (!pool)
+        {
+            return -1;
+        }
+
+        snprintf(name, sizeof(name), "%s", local ? "shared memory" : cfg->provider);
+        run_local_pass(pool, name);
+        client_pool_close(pool);
+    }
+
+    return 0;
+}
+
+// how evenly the ring spreads stripes, and how many move when the last server leaves
+#define RING_SAMPLE_KEYS 100000
+
+static void print_ring_balance(const struct client_server *servers, int server_count)
+{
+    char names[MAX_POOL_SERVERS][64];
+    const char *name_ptrs[MAX_POOL_SERVERS];
+    struct hash_ring full, shrunk;
+    int counts[MAX_POOL_SERVERS] = {0};
+    int moved = 0;
+
+    for (int i = 0; i < server_count; i++)
+    {
+        snprintf(names[i], sizeof(names[i]), "%s:%u", servers[i].addr, servers[i].port);
+        name_ptrs[i] = names[i];
+    }
+
+    if (ring_init(&full, name_ptrs, server_count, RING_VNODES) < 0)
+    {
+        return;
+    }
+    if (server_count < 2 || ring_init(&shrunk, name_ptrs, server_count - 1, RING_VNODES) < 0)
+    {
+        ring_free(&full);
+        return;
+    }
+
+    for (uint64_t key = 0; key < RING_SAMPLE_KEYS; key++)
+    {
+        int owner = ring_lookup(&full, key, NULL);
+
+        counts[owner]++;
+        if (owner != ring_lookup(&shrunk, key, NULL))
+        {
+            moved++;
+        }
+    }
+
+    for (int i = 0; i < server_count; i++)
+    {
+        printf("ring: %s owns %.1f%% of stripes\n", names[i], counts[i] * 100.0 / RING_SAMPLE_KEYS);
+    }
+    // only the departing server's keys should move
+    printf("ring: removing %s moves %.1f%% of stripes\n", names[server_count - 1],
+           moved * 100.0 / RING_SAMPLE_KEYS);
+
+    ring_free(&shrunk);
+    ring_free(&full);
+}
+
+static void count_done(int status, void *arg)
+{
+    int *count = arg;
+
+    if (status)
+    {
+        fprintf(stderr, "async read failed: %d\n", status);
+    }
+
+    __atomic_add_fetch(count, 1, __ATOMIC_SEQ_CST);
+}
+
+int run_pool_client(const struct net_config *cfg, const struct client_server *servers,
+                    int server_count, int threads, enum client_layout layout, bool replicate)
+{
+    struct client_pool *pool;
+    struct net_config fabric_cfg;
+    struct pool_worker *workers = calloc(threads, sizeof(*workers));
+    struct timespec start;
+    char async_bufs[MAX_BATCH][64];
+    int async_done = 0;
+    int errors = 0;
+    struct client_pool_attr attr = {
+        .cxns_per_server = threads < 4 ? threads : 4,
+        .layout = layout,
+        .replicate = replicate,
+        .net = cfg,
+    };
+    uint64_t ns;
+
+    if (server_count * attr.cxns_per_server > MAX_CONNECTIONS)
+    {
+        attr.cxns_per_server = MAX_CONNECTIONS / server_count;
+    }
+
+    if (layout == LAYOUT_HASHED)
+    {
+        print_ring_balance(servers, server_count);
+    }
+
+    pool = client_pool_open(servers, server_count, &attr);
+    if (!pool)
+    {
+        free(workers);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i] = (struct pool_worker){.pool = pool, .id = i};
+        pthread_create(&workers[i].thread, NULL, pool_worker_thread, &workers[i]);
+    }
+
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        errors += workers[i].errors;
+    }
+
+    ns = elapsed_ns(&start);
+    printf("pool: %d threads, %d ops of %d bytes, %.0f ops/s, %d errors\n", threads,
+           threads * POOL_ITERS * 2, POOL_OP_LEN, threads * POOL_ITERS * 2 * 1e9 / ns, errors);
+
+    // callback style, everything in flight at once
+    for (int i = 0; i < MAX_BATCH; i++)
+    {
+        client_read_async(pool, POOL_BASE_ADDR + i * 64, async_bufs[i], 64, count_done,
+                          &async_done);
+    }
+
+    while (__atomic_load_n(&async_done, __ATOMIC_SEQ_CST) < MAX_BATCH)
+    {
+        usleep(100);
+    }
+    printf("pool: %d async reads done\n", async_done);
+
+    errors += run_stripe_bench(pool, server_count * attr.cxns_per_server, "pool");
+
+    client_pool_close(pool);
+    free(workers);
+
+    // the cost of checksums and the gain from compression, over the fabric even for servers on
+    // this host since stripes copied through shared memory skip both. compress_min has to be set
+    // when connecting for the servers to agree to compression
+    fabric_cfg = *cfg;
+    if (!fabric_cfg.compress_min)
+    {
+        fabric_cfg.compress_min = BENCH_COMPRESS_MIN;
+    }
+    attr.net = &fabric_cfg;
+    attr.no_local_path = true;
+    pool = client_pool_open(servers, server_count, &attr);
+    if (!pool)
+    {
+        return -1;
+    }
+
+    printf("crc32c: %s\n", crc32c_impl());
+    client_pool_set_compress(pool, 0);
+    client_pool_set_verify(pool, false);
+    errors += run_stripe_bench(pool, server_count * attr.cxns_per_server, "unverified");
+    client_pool_set_verify(pool, true);
+    errors += run_stripe_bench(pool, server_count * attr.cxns_per_server, "verified");
+    client_pool_set_verify(pool, false);
+    client_pool_set_compress(pool, fabric_cfg.compress_min);
+    errors += run_stripe_bench(pool, server_count * attr.cxns_per_server, "compressed");
+
+    client_pool_close(pool);
+
+    return errors ? -1 : 0;
+}
@@ -0,0 +1,1022 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_domain.h>
+#include <rdma/fi_eq.h>
+
+#include "client_pool.h"
+#include "crc32c.h"
+#include "hash_ring.h"
+#include "log.h"
+#include "lz.h"
+#include "mem.h"
+#include "network.h"
+#include "obj_pool.h"
+#include "read_cache.h"
+
+enum client_op_type
+{
+    CLIENT_READ = 0,
+    CLIENT_WRITE
+};
+
+// the fields the progress thread touches for every stripe fill the first cache line, ops come
+// CACHE_LINE aligned from op_pool
+struct client_op
+{
+    uint64_t op_addr;
+    char *buf;
+    size_t len;
+    // stripes are handed out from issued_len and may finish in any order, the op stays on the
+    // wait list until every stripe has been issued
+    size_t issued_len;
+    // counts every copy of a replicated write
+    size_t done_len;
+    struct client_pool *pool;
+    struct client_op *next;
+    int copies;
+    int inflight;
+
+    enum client_op_type type;
+    int status;
+    bool waiting;
+    bool done;
+    client_op_cb cb;
+    void *arg;
+};
+
+// ops are allocated by the submitting threads and mostly freed on the progress thread
+static struct obj_pool op_pool = OBJ_POOL_INIT(struct client_op);
+
+// cached stripes are cut at block boundaries, which must never cross a server's range
+_Static_assert(STRIPE_SIZE % LEASE_BLOCK == 0, "stripes must hold whole lease blocks");
+
+// one connection and the op it's currently moving a stripe for
+struct pool_cxn
+{
+    struct connection *cxn;
+    int server;
+    struct network_request rq;
+    struct client_op *op;
+    size_t chunk_off;
+    size_t chunk_len;
+    uint64_t server_addr;
+    // waiting on immediate data rather than a reply
+    bool imm;
+    // the stripe may come back compressed
+    bool lz;
+    // sent with CMD_FLAG_CRC, latched with lz in start_chunk so a setter can't change how a stripe
+    // in flight is checked
+    bool crc;
+    // read cache slot the stripe's whole block is filled into, -1 if it goes through the bulk
+    // buffer
+    int cache_slot;
+    uint32_t cache_version;
+};
+
+struct client_pool
+{
+    struct net_info ni;
+
+    struct client_server servers[MAX_POOL_SERVERS];
+    char server_names[MAX_POOL_SERVERS][64];
+    int server_count;
+    enum client_layout layout;
+    bool replicate;
+    struct hash_ring ring;
+    // CRC32C on every stripe over the fabric, see CMD_FLAG_CRC
+    bool verify;
+    // stripes of at least this many bytes are compressed, with servers that agreed to it
+    size_t compress_min;
+
+    // mapped stores of servers on this host, NULL for remote ones
+    void *local_stores[MAX_POOL_SERVERS];
+    size_t local_sizes[MAX_POOL_SERVERS];
+
+    // reads of servers that agreed to FEATURE_LEASE go through it, NULL without read_cache_size
+    struct read_cache *cache;
+    // 0 for servers that don't lease
+    uint64_t lease_ms[MAX_POOL_SERVERS];
+
+    struct pool_cxn *cxns;
+    int cxn_count;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    // progress thread sleeps on this while idle
+    pthread_cond_t submit_cond;
+    // future waiters sleep on this
+    pthread_cond_t done_cond;
+    bool running;
+
+    // new ops, protected by lock
+    struct client_op *submit_head;
+    struct client_op *submit_tail;
+
+    // progress thread only, ops waiting for an idle connection to their server
+    struct client_op *wait_head;
+    struct client_op *wait_tail;
+    int outstanding;
+};
+
+// where the bytes at addr live, and how many can be moved before the next server's range starts.
+// replica is only set for the hashed layout
+static int route(struct client_pool *pool, uint64_t addr, uint64_t *server_addr, size_t *max_len,
+                 int *replica)
+{
+    uint64_t stripe;
+
+    *replica = -1;
+
+    if (pool->layout == LAYOUT_HASHED)
+    {
+        *server_addr = addr % STORE_SIZE;
+        *max_len = STRIPE_SIZE - addr % STRIPE_SIZE;
+
+        return ring_lookup(&pool->ring, addr / STRIPE_SIZE, replica);
+    }
+
+    if (pool->layout == LAYOUT_CONTIGUOUS)
+    {
+        *server_addr = addr % STORE_SIZE;
+        *max_len = STORE_SIZE - *server_addr;
+
+        return (addr / STORE_SIZE) % pool->server_count;
+    }
+
+    stripe = addr / STRIPE_SIZE;
+    *server_addr = (stripe / pool->server_count) * STRIPE_SIZE + addr % STRIPE_SIZE;
+    *max_len = STRIPE_SIZE - addr % STRIPE_SIZE;
+
+    return stripe % pool->server_count;
+}
+
+// bytes of global address space the layout covers. Past it route would wrap onto other addresses
+static uint64_t layout_capacity(struct client_pool *pool)
+{
+    if (pool->layout == LAYOUT_HASHED)
+    {
+        return STORE_SIZE;
+    }
+
+    return (uint64_t)pool->server_count * STORE_SIZE;
+}
+
+static void op_append(struct client_op **head, struct client_op **tail, struct client_op *op)
+{
+    op->next = NULL;
+    if (*tail)
+    {
+        (*tail)->next = op;
+    }
+    else
+    {
+        *head = op;
+    }
+    *tail = op;
+}
+
+static void finish_op(struct client_pool *pool, struct client_op *op, int status)
+{
+    op->status = status;
+    pool->outstanding--;
+
+    // even a failed write may have stored some of its stripes
+    if (op->type == CLIENT_WRITE && pool->cache)
+    {
+        read_cache_invalidate(pool->cache, op->op_addr, op->len);
+    }
+
+    if (op->cb)
+    {
+        op->cb(status, op->arg);
+        obj_free(&op_pool, op);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    op->done = true;
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// moves a read stripe from the bulk buffer into the op's buffer, expanding it if the server
+// compressed it, and checks it. Done as each stripe lands, so the others keep moving meanwhile
+static int land_chunk(struct client_pool *pool, struct pool_cxn *pc, bool imm)
+{
+    struct connection *cxn = pc->cxn;
+    char *dst = pc->op->buf + pc->chunk_off;
+    uint32_t crc = imm ? (uint32_t)cxn->imm_data : cxn->cmd_buf->crc;
+    uint32_t lz_len = 0;
+
+    if (pc->lz)
+    {
+        lz_len = imm ? cxn->imm_data >> 32 : cxn->cmd_buf->lz_len;
+    }
+
+    if (!lz_len)
+    {
+        memcpy(dst, cxn->bulk_buf, pc->chunk_len);
+    }
+    else if (lz_len > BULK_SIZE ||
+             lz_decompress(cxn->bulk_buf, lz_len, dst, pc->chunk_len) != pc->chunk_len)
+    {
+        fprintf(stderr, "bad compressed stripe at %llx, %u bytes\n",
+                (unsigned long long)pc->server_addr, lz_len);
+        return -FI_EIO;
+    }
+
+    if (pc->crc && crc32c(0, dst, pc->chunk_len) != crc)
+    {
+        fprintf(stderr, "crc mismatch reading %zu bytes at %llx\n", pc->chunk_len,
+                (unsigned long long)pc->server_addr);
+        return -FI_EIO;
+    }
+
+    return 0;
+}
+
+// the stripe's whole block went into its cache slot, or was already there if the server only
+// revalidated it. The stripe is copied out and the slot kept if the server granted the lease
+static int land_cached(struct client_pool *pool, struct pool_cxn *pc, int status)
+{
+    struct network_cmd *cmd = pc->cxn->cmd_buf;
+
+    if (!status && pc->crc &&
+        crc32c(0, read_cache_slot(pool->cache, pc->cache_slot), LEASE_BLOCK) != cmd->crc)
+    {
+        fprintf(stderr, "crc mismatch reading block at %llx\n", (unsigned long long)cmd->op_addr);
+        status = -FI_EIO;
+    }
+
+    read_cache_fill_done(pool->cache, pc->cache_slot, status, cmd->version,
+                         pc->server_addr % LEASE_BLOCK, pc->op->buf + pc->chunk_off,
+                         pc->chunk_len);
+
+    return status;
+}
+
+static void chunk_done(struct network_request *rq)
+{
+    struct pool_cxn *pc = rq->rq_data;
+    struct client_op *op = pc->op;
+    struct client_pool *pool = op->pool;
+    int status = rq->rq_res ? rq->rq_res : pc->cxn->cmd_buf->status;
+    // handle_completion clears imm_rq when the immediate data is what arrived
+    bool imm = pc->imm && !pc->cxn->imm_rq;
+
+    // whichever of the reply or the immediate data arrived, the other isn't coming
+    pc->cxn->imm_rq = NULL;
+    pc->cxn->recv_rq = NULL;
+    op->inflight--;
+
+    if (pc->cache_slot >= 0)
+    {
+        status = land_cached(pool, pc, status);
+    }
+    else if (!status && op->type == CLIENT_READ)
+    {
+        status = land_chunk(pool, pc, imm);
+    }
+    pc->op = NULL;
+
+    if (status)
+    {
+        // keep the first error, dispatch stops issuing stripes for a failed op
+        if (!op->status)
+        {
+            op->status = status;
+        }
+    }
+    else
+    {
+        op->done_len += pc->chunk_len;
+    }
+
+    // an op still on the wait list is finished by dispatch once it notices the error
+    if (op->inflight == 0 && !op->waiting && (op->status || op->done_len == op->len * op->copies))
+    {
+        finish_op(pool, op, op->status);
+    }
+}
+
+static void chunk_sent(struct network_request *rq)
+{
+    rq->callback = chunk_done;
+
+    // no reply is coming for a command that didn't go out
+    if (rq->rq_res)
+    {
+        chunk_done(rq);
+        return;
+    }
+
+    cmd_recv(rq);
+}
+
+// wire types are from the server's point of view, a client read is a server PUT
+static void start_chunk(struct pool_cxn *pc)
+{
+    struct client_op *op = pc->op;
+    struct connection *cxn = pc->cxn;
+    struct network_cmd *cmd = cxn->cmd_buf;
+    size_t compress_min = __atomic_load_n(&op->pool->compress_min, __ATOMIC_RELAXED);
+
+    pc->rq.rq_res = 0;
+    pc->imm = false;
+    pc->lz = compress_min && pc->chunk_len >= compress_min &&
+             (cxn->remote_keys.features & FEATURE_LZ);
+    pc->crc = __atomic_load_n(&op->pool->verify, __ATOMIC_RELAXED);
+    op->inflight++;
+
+    memset(cmd, 0, offsetof(struct network_cmd, batch));
+    cmd->type = op->type == CLIENT_READ ? PUT : GET;
+    // every stripe is small, only the op knows it's part of a large transfer
+    cmd->priority = op->len > STRIPE_SIZE ? PRIO_BULK : PRIO_DEFAULT;
+    cmd->op_addr = pc->server_addr;
+    cmd->rma_iov.addr = get_bulk_offset(cxn->bulk_buf);
+    cmd->rma_iov.len = pc->chunk_len;
+    cmd->rma_iov.key = fi_mr_key(get_bulk_mr());
+
+    if (op->type == CLIENT_WRITE)
+    {
+        const char *src = op->buf + pc->chunk_off;
+
+        // stripes that don't compress go out as they are
+        if (pc->lz)
+        {
+            cmd->lz_len = lz_compress(src, pc->chunk_len, cxn->bulk_buf, lz_target(pc->chunk_len));
+        }
+
+        if (cmd->lz_len)
+        {
+            cmd->flags |= CMD_FLAG_LZ;
+        }
+        else
+        {
+            memcpy(cxn->bulk_buf, src, pc->chunk_len);
+        }
+    }
+    else if (pc->lz)
+    {
+        cmd->flags |= CMD_FLAG_LZ;
+    }
+
+    if (pc->crc)
+    {
+        cmd->flags |= CMD_FLAG_CRC;
+        if (op->type == CLIENT_WRITE)
+        {
+            cmd->crc = crc32c(0, op->buf + pc->chunk_off, pc->chunk_len);
+        }
+    }
+
+    // the whole block, straight into the cache slot. The reply carries the version
+    if (pc->cache_slot >= 0)
+    {
+        struct read_cache *cache = op->pool->cache;
+
+        cmd->flags = (cmd->flags & ~CMD_FLAG_LZ) | CMD_FLAG_LEASE;
+        cmd->op_addr = pc->server_addr - pc->server_addr % LEASE_BLOCK;
+        cmd->rma_iov.addr = read_cache_slot_addr(cache, pc->cache_slot);
+        cmd->rma_iov.len = LEASE_BLOCK;
+        cmd->rma_iov.key = read_cache_key(cache);
+        cmd->version = pc->cache_version;
+        pc->lz = false;
+    }
+
+    if (op->type == CLIENT_READ && cxn->ni->remote_cq_data && pc->cache_slot < 0)
+    {
+        // completes on the immediate data, or on a reply if the server rejects the command
+        cmd->flags |= CMD_FLAG_IMM;
+        pc->imm = true;
+        pc->rq.callback = chunk_done;
+        cxn->imm_rq = &pc->rq;
+        cmd_recv(&pc->rq);
+        cmd_send_untracked(cxn);
+    }
+    else
+    {
+        pc->rq.callback = chunk_sent;
+        cmd_send(&pc->rq);
+    }
+}
+
+static struct pool_cxn *idle_cxn(struct client_pool *pool, int server)
+{
+    for (int i = 0; i < pool->cxn_count; i++)
+    {
+        if (pool->cxns[i].server == server && !pool->cxns[i].op)
+        {
+            return &pool->cxns[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void set_stripe(struct pool_cxn *pc, struct client_op *op, size_t len,
+                       uint64_t server_addr)
+{
+    pc->op = op;
+    pc->chunk_off = op->issued_len;
+    pc->chunk_len = len;
+    pc->server_addr = server_addr;
+    pc->cache_slot = -1;
+}
+
+// a stripe for a server sharing its store, done in place
+static void local_copy(struct client_pool *pool, struct client_op *op, int server, size_t off,
+                       uint64_t server_addr, size_t len)
+{
+    char *store = pool->local_stores[server];
+
+    if (server_addr > pool->local_sizes[server] || len > pool->local_sizes[server] - server_addr)
+    {
+        // same as the server rejecting it
+        op->status = op->status ? op->status : -FI_ERANGE;
+        return;
+    }
+
+    if (op->type == CLIENT_READ)
+    {
+        memcpy(op->buf + off, store + server_addr, len);
+    }
+    else
+    {
+        memcpy(store + server_addr, op->buf + off, len);
+    }
+    op->done_len += len;
+}
+
+// issue the next stripe of op if a connection to its server is idle. Both copies of a
+// replicated write go out together
+static bool issue_stripe(struct client_pool *pool, struct client_op *op)
+{
+    uint64_t addr = op->op_addr + op->issued_len;
+    uint64_t server_addr;
+    size_t max_len;
+    size_t len = op->len - op->issued_len;
+    int replica;
+    int server = route(pool, addr, &server_addr, &max_len, &replica);
+    bool local = pool->local_stores[server] != NULL;
+    bool replica_local = op->copies > 1 && pool->local_stores[replica] != NULL;
+    bool cached = op->type == CLIENT_READ && pool->cache && pool->lease_ms[server];
+    struct pool_cxn *pc = NULL;
+    struct pool_cxn *replica_pc = NULL;
+
+    if (len > max_len)
+    {
+        len = max_len;
+    }
+    if (len > BULK_SIZE)
+    {
+        len = BULK_SIZE;
+    }
+
+    // a cached stripe stays within one block, and may not need a connection at all
+    if (cached)
+    {
+        if (len > LEASE_BLOCK - addr % LEASE_BLOCK)
+        {
+            len = LEASE_BLOCK - addr % LEASE_BLOCK;
+        }
+
+        if (read_cache_read(pool->cache, addr, op->buf + op->issued_len, len))
+        {
+            op->issued_len += len;
+            op->done_len += len;
+            return true;
+        }
+    }
+
+    if (!local && !(pc = idle_cxn(pool, server)))
+    {
+        return false;
+    }
+
+    if (op->copies > 1 && !replica_local && !(replica_pc = idle_cxn(pool, replica)))
+    {
+        return false;
+    }
+
+    if (local)
+    {
+        local_copy(pool, op, server, op->issued_len, server_addr, len);
+    }
+    if (replica_local)
+    {
+        local_copy(pool, op, replica, op->issued_len, server_addr, len);
+    }
+    if (pc)
+    {
+        set_stripe(pc, op, len, server_addr);
+    }
+    // a block another stripe is already filling goes through the bulk buffer instead
+    if (pc && cached)
+    {
+        pc->cache_slot = read_cache_reserve(pool->cache, addr - addr % LEASE_BLOCK,
+                                            pool->lease_ms[server], &pc->cache_version);
+    }
+    if (replica_pc)
+    {
+        set_stripe(replica_pc, op, len, server_addr);
+    }
+    op->issued_len += len;
+
+    if (pc)
+    {
+        start_chunk(pc);
+    }
+    if (replica_pc)
+    {
+        start_chunk(replica_pc);
+    }
+
+    return true;
+}
+
+// true if every stripe of op, and its replica, is on a server sharing its store
+static bool op_is_local(struct client_pool *pool, struct client_op *op)
+{
+    size_t off = 0;
+
+    while (off < op->len)
+    {
+        uint64_t server_addr;
+        size_t max_len;
+        int replica;
+        int server = route(pool, op->op_addr + off, &server_addr, &max_len, &replica);
+
+        if (!pool->local_stores[server] || (op->copies > 1 && !pool->local_stores[replica]))
+        {
+            return false;
+        }
+
+        off += max_len;
+    }
+
+    return true;
+}
+
+// all of op in the caller's thread, for ops that never need the fabric
+static int run_local(struct client_pool *pool, struct client_op *op)
+{
+    while (op->issued_len < op->len && !op->status)
+    {
+        issue_stripe(pool, op);
+    }
+
+    return op->status;
+}
+
+// hand waiting ops to idle connections, as many stripes at once as there are connections free.
+// Ops for busy servers don't hold up the others
+static void dispatch(struct client_pool *pool)
+{
+    struct client_op **prev = &pool->wait_head;
+    struct client_op *op = pool->wait_head;
+
+    pool->wait_tail = NULL;
+    while (op)
+    {
+        struct client_op *next = op->next;
+
+        while (!op->status && op->issued_len < op->len && issue_stripe(pool, op))
+        {
+        }
+
+        if (op->status || op->issued_len == op->len)
+        {
+            // the last stripe to complete finishes it
+            *prev = next;
+            op->waiting = false;
+            if (op->inflight == 0)
+            {
+                finish_op(pool, op, op->status);
+            }
+        }
+        else
+        {
+            pool->wait_tail = op;
+            prev = &op->next;
+        }
+
+        op = next;
+    }
+}
+
+// a server going away fails whatever its connection was waiting on, and every stripe sent to
+// it after that
+static void process_eq_events(struct client_pool *pool)
+{
+    struct fi_eq_cm_entry entry;
+    uint32_t event;
+    int rc;
+
+    while ((rc = fi_eq_read(pool->ni.eq, &event, &entry, sizeof(entry), 0)) != -FI_EAGAIN)
+    {
+        if (rc == -FI_EAVAIL)
+        {
+            struct fi_eq_err_entry eqee;
+
+            fi_eq_readerr(pool->ni.eq, &eqee, 0);
+            fprintf(stderr, "client pool: eq error %d\n", eqee.err);
+            continue;
+        }
+        else if (rc < 0)
+        {
+            fprintf(stderr, "client pool: fi_eq_read %d\n", rc);
+            return;
+        }
+
+        if (event != FI_SHUTDOWN)
+        {
+            continue;
+        }
+
+        for (int i = 0; i < pool->cxn_count; i++)
+        {
+            if (&pool->cxns[i].cxn->ep->fid == entry.fid)
+            {
+                connection_fail(pool->cxns[i].cxn, -FI_ECONNRESET);
+            }
+        }
+    }
+}
+
+static void *progress_thread(void *arg)
+{
+    struct client_pool *pool = arg;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->running && !pool->submit_head && !pool->outstanding)
+        {
+            pthread_cond_wait(&pool->submit_cond, &pool->lock);
+        }
+
+        if (!pool->running && !pool->submit_head && !pool->outstanding)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+
+        while (pool->submit_head)
+        {
+            struct client_op *op = pool->submit_head;
+            pool->submit_head = op->next;
+
+            op_append(&pool->wait_head, &pool->wait_tail, op);
+            op->waiting = true;
+            pool->outstanding++;
+        }
+        pool->submit_tail = NULL;
+        pthread_mutex_unlock(&pool->lock);
+
+        dispatch(pool);
+        post_flush_all(&pool->ni);
+
+        if (!pool->outstanding)
+        {
+            continue;
+        }
+
+        // short timeout so ops submitted while we're blocked here don't wait long
+        int rc = fi_wait(pool->ni.wait_set, 1);
+        if (rc < 0 && rc != -FI_ETIMEDOUT)
+        {
+            fprintf(stderr, "client pool: error waiting: %d\n", rc);
+        }
+
+        process_eq_events(pool);
+        process_all_cq_events(&pool->ni);
+    }
+
+    return NULL;
+}
+
+// an op finished in the submitting thread
+static struct client_op *finish_now(struct client_op *op, int status)
+{
+    op->status = status;
+    op->done = true;
+    if (op->cb)
+    {
+        op->cb(status, op->arg);
+        obj_free(&op_pool, op);
+    }
+
+    return op;
+}
+
+static struct client_op *submit(struct client_pool *pool, enum client_op_type type,
+                                uint64_t op_addr, void *buf, size_t len, client_op_cb cb,
+                                void *arg)
+{
+    struct client_op *op = obj_alloc(&op_pool);
+
+    if (!op)
+    {
+        return NULL;
+    }
+    memset(op, 0, sizeof(*op));
+
+    op->type = type;
+    op->op_addr = op_addr;
+    op->buf = buf;
+    op->len = len;
+    op->cb = cb;
+    op->arg = arg;
+    op->pool = pool;
+    // a ring with one server has no replica
+    op->copies = type == CLIENT_WRITE && pool->replicate && pool->server_count > 1 ? 2 : 1;
+
+    if (op_addr > layout_capacity(pool) || len > layout_capacity(pool) - op_addr)
+    {
+        return finish_now(op, -FI_ERANGE);
+    }
+
+    // local_stores is only written while the pool is opened, so this needs no lock. A read that's
+    // entirely in the read cache completes here too
+    if (type == CLIENT_READ && pool->cache && read_cache_read(pool->cache, op_addr, buf, len))
+    {
+        return finish_now(op, 0);
+    }
+    else if (len == 0 || op_is_local(pool, op))
+    {
+        return finish_now(op, len ? run_local(pool, op) : 0);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    op_append(&pool->submit_head, &pool->submit_tail, op);
+    pthread_cond_signal(&pool->submit_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return op;
+}
+
+int client_read_async(struct client_pool *pool, uint64_t op_addr, void *buf, size_t len,
+                      client_op_cb cb, void *arg)
+{
+    return submit(pool, CLIENT_READ, op_addr, buf, len, cb, arg) ? 0 : -FI_ENOMEM;
+}
+
+int client_write_async(struct client_pool *pool, uint64_t op_addr, const void *buf, size_t len,
+                       client_op_cb cb, void *arg)
+{
+    return submit(pool, CLIENT_WRITE, op_addr, (void *)buf, len, cb, arg) ? 0 : -FI_ENOMEM;
+}
+
+struct client_op *client_read_future(struct client_pool *pool, uint64_t op_addr, void *buf,
+                                     size_t len)
+{
+    return submit(pool, CLIENT_READ, op_addr, buf, len, NULL, NULL);
+}
+
+struct client_op *client_write_future(struct client_pool *pool, uint64_t op_addr,
+                                      const void *buf, size_t len)
+{
+    return submit(pool, CLIENT_WRITE, op_addr, (void *)buf, len, NULL, NULL);
+}
+
+bool client_op_done(struct client_op *op)
+{
+    bool done;
+
+    pthread_mutex_lock(&op->pool->lock);
+    done = op->done;
+    pthread_mutex_unlock(&op->pool->lock);
+
+    return done;
+}
+
+int client_op_wait(struct client_op *op)
+{
+    struct client_pool *pool = op->pool;
+    int status;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!op->done)
+    {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    status = op->status;
+    obj_free(&op_pool, op);
+
+    return status;
+}
+
+int client_read(struct client_pool *pool, uint64_t op_addr, void *buf, size_t len)
+{
+    struct client_op *op = client_read_future(pool, op_addr, buf, len);
+
+    return op ? client_op_wait(op) : -FI_ENOMEM;
+}
+
+int client_write(struct client_pool *pool, uint64_t op_addr, const void *buf, size_t len)
+{
+    struct client_op *op = client_write_future(pool, op_addr, buf, len);
+
+    return op ? client_op_wait(op) : -FI_ENOMEM;
+}
+
+struct client_pool *client_pool_open(const struct client_server *servers, int server_count,
+                                     const struct client_pool_attr *attr)
+{
+    struct client_pool *pool;
+    const char *names[MAX_POOL_SERVERS];
+    struct net_config defaults;
+    int cxns_per_server = attr->cxns_per_server;
+    int rc;
+
+    if (server_count < 1 || server_count > MAX_POOL_SERVERS || cxns_per_server < 1 ||
+        server_count * cxns_per_server > MAX_CONNECTIONS)
+    {
+        rc = -FI_EINVAL;
+        GOTO(err, "bad pool size: %d servers, %d connections each", server_count,
+             cxns_per_server);
+    }
+
+    if (attr->replicate && attr->layout != LAYOUT_HASHED)
+    {
+        rc = -FI_EINVAL;
+        GOTO(err, "replication needs the hashed layout");
+    }
+
+    pool = calloc(1, sizeof(*pool));
+    pool->cxns = calloc(server_count * cxns_per_server, sizeof(struct pool_cxn));
+    pool->server_count = server_count;
+    pool->layout = attr->layout;
+    pool->replicate = attr->replicate;
+    memcpy(pool->servers, servers, server_count * sizeof(*servers));
+
+    for (int i = 0; i < server_count; i++)
+    {
+        snprintf(pool->server_names[i], sizeof(pool->server_names[i]), "%s:%u",
+                 servers[i].addr, servers[i].port);
+        names[i] = pool->server_names[i];
+    }
+
+    rc = ring_init(&pool->ring, names, server_count, RING_VNODES);
+    if (rc < 0)
+    {
+        GOTO(err1, "ring_init");
+    }
+
+    config_defaults(&defaults);
+    rc = init_network(&pool->ni, false, attr->net ? attr->net : &defaults);
+    if (rc < 0)
+    {
+        GOTO(err1, "init_network");
+    }
+    pool->verify = pool->ni.cfg.verify;
+    pool->compress_min = pool->ni.cfg.compress_min;
+
+    for (int i = 0; i < server_count; i++)
+    {
+        for (int j = 0; j < cxns_per_server; j++)
+        {
+            struct pool_cxn *pc = &pool->cxns[pool->cxn_count];
+
+            rc = setup_connection(&pool->ni, &pc->cxn, pool->ni.fi);
+            if (rc < 0)
+            {
+                GOTO(err2, "setup_connection");
+            }
+            pool->cxn_count++;
+
+            rc = connect_to_server(&pool->ni, pc->cxn, servers[i].addr, servers[i].port);
+            if (rc < 0)
+            {
+                GOTO(err2, "connect_to_server %s:%d", servers[i].addr, servers[i].port);
+            }
+
+            pc->server = i;
+            pc->rq.cxn = pc->cxn;
+            pc->rq.rq_data = pc;
+            pc->cache_slot = -1;
+
+            if (j == 0 && (pc->cxn->remote_keys.features & FEATURE_LEASE))
+            {
+                pool->lease_ms[i] = pc->cxn->remote_keys.lease_ms;
+            }
+
+            if (j == 0 && !attr->no_local_path && pc->cxn->remote_keys.host_id &&
+                pc->cxn->remote_keys.host_id == get_host_id())
+            {
+                pool->local_stores[i] = open_shared_store(servers[i].port, &pool->local_sizes[i]);
+                printf("client pool: %s:%u is %s\n", servers[i].addr, servers[i].port,
+                       pool->local_stores[i] ? "local, using shared memory" : "local, not shared");
+            }
+        }
+    }
+
+    // only worth it if some server leases, without the cache reads just go over the fabric
+    for (int i = 0; i < server_count && pool->ni.cfg.read_cache_size && !pool->cache; i++)
+    {
+        if (pool->lease_ms[i])
+        {
+            pool->cache = read_cache_open(&pool->ni, pool->ni.cfg.read_cache_size);
+        }
+    }
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->submit_cond, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+    pool->running = true;
+
+    rc = pthread_create(&pool->thread, NULL, progress_thread, pool);
+    if (rc)
+    {
+        rc = -rc;
+        GOTO(err3, "pthread_create");
+    }
+
+    return pool;
+
+err3:
+    if (pool->cache)
+    {
+        read_cache_close(pool->cache);
+    }
+err2:
+    for (int i = 0; i < pool->cxn_count; i++)
+    {
+        close_connection(pool->cxns[i].cxn);
+        free(pool->cxns[i].cxn);
+    }
+    for (int i = 0; i < server_count; i++)
+    {
+        if (pool->local_stores[i])
+        {
+            close_shared_store(pool->local_stores[i], pool->local_sizes[i]);
+        }
+    }
+    close_network(&pool->ni);
+err1:
+    ring_free(&pool->ring);
+    free(pool->cxns);
+    free(pool);
+err:
+    return NULL;
+}
+
+// stripes started from now on use the new value, start_chunk latches it per stripe
+void client_pool_set_verify(struct client_pool *pool, bool verify)
+{
+    __atomic_store_n(&pool->verify, verify, __ATOMIC_RELAXED);
+}
+
+// same as client_pool_set_verify
+void client_pool_set_compress(struct client_pool *pool, size_t min_len)
+{
+    __atomic_store_n(&pool->compress_min, min_len, __ATOMIC_RELAXED);
+}
+
+// waits for every submitted op to finish before tearing the connections down
+void client_pool_close(struct client_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->running = false;
+    pthread_cond_signal(&pool->submit_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_join(pool->thread, NULL);
+
+    for (int i = 0; i < pool->cxn_count; i++)
+    {
+        close_connection(pool->cxns[i].cxn);
+        free(pool->cxns[i].cxn);
+    }
+    pool->ni.connection_list = NULL;
+
+    if (pool->cache)
+    {
+        read_cache_close(pool->cache);
+    }
+
+    for (int i = 0; i < pool->server_count; i++)
+    {
+        if (pool->local_stores[i])
+        {
+            close_shared_store(pool->local_stores[i], pool->local_sizes[i]);
+        }
+    }
+
+    close_network(&pool->ni);
+
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_cond_destroy(&pool->submit_cond);
+    pthread_mutex_destroy(&pool->lock);
+
+    ring_free(&pool->ring);
+    free(pool->cxns);
+    free(pool);
+}
@@ -0,0 +1,329 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rdma/fi_errno.h>
+
+#include "config.h"
+#include "log.h"
+#include "network.h"
+#include "qos.h"
+
+void config_defaults(struct net_config *cfg)
+{
+    memset(cfg, 0, sizeof(*cfg));
+    snprintf(cfg->provider, sizeof(cfg->provider), "%s", DEFAULT_PROVIDER);
+    snprintf(cfg->addr, sizeof(cfg->addr), "%s", DEFAULT_ADDR);
+    cfg->port = DEFAULT_PORT;
+    cfg->ep_type = FI_EP_MSG;
+    cfg->mr_mode = FI_MR_SCALABLE;
+    cfg->rx_depth = DEFAULT_RX_DEPTH;
+    cfg->idle_timeout = DEFAULT_IDLE_TIMEOUT;
+    cfg->imm_data = true;
+    cfg->qos_small_max = QOS_DEFAULT_SMALL_MAX;
+    cfg->qos_bulk_bytes = QOS_DEFAULT_BULK_BYTES;
+    cfg->qos_weight = 1;
+}
+
+static int parse_size(const char *value, size_t *out)
+{
+    char *end;
+    unsigned long long n = strtoull(value, &end, 0);
+
+    if (end == value || *end)
+    {
+        return -FI_EINVAL;
+    }
+
+    *out = n;
+
+    return 0;
+}
+
+int config_set(struct net_config *cfg, const char *key, const char *value)
+{
+    size_t n;
+    int rc = 0;
+
+    if (!strcmp(key, "provider"))
+    {
+        snprintf(cfg->provider, sizeof(cfg->provider), "%s", value);
+    }
+    else if (!strcmp(key, "addr"))
+    {
+        snprintf(cfg->addr, sizeof(cfg->addr), "%s", value);
+    }
+    else if (!strcmp(key, "port"))
+    {
+        rc = parse_size(value, &n);
+        if (rc == 0 && (n == 0 || n > 65535))
+        {
+            rc = -FI_EINVAL;
+        }
+        cfg->port = rc ? cfg->port : n;
+    }
+    else if (!strcmp(key, "ep_type"))
+    {
+        if (!strcmp(value, "msg"))
+        {
+            cfg->ep_type = FI_EP_MSG;
+        }
+        else if (!strcmp(value, "rdm"))
+        {
+            cfg->ep_type = FI_EP_RDM;
+        }
+        else if (!strcmp(value, "dgram"))
+        {
+            cfg->ep_type = FI_EP_DGRAM;
+        }
+        else
+        {
+            rc = -FI_EINVAL;
+        }
+    }
+    else if (!strcmp(key, "mr_mode"))
+    {
+        if (!strcmp(value, "scalable"))
+        {
+            cfg->mr_mode = FI_MR_SCALABLE;
+        }
+        else if (!strcmp(value, "basic"))
+        {
+            cfg->mr_mode = FI_MR_BASIC;
+        }
+        else
+        {
+            rc = -FI_EINVAL;
+        }
+    }
+    else if (!strcmp(key, "rx_depth"))
+    {
+        rc = parse_size(value, &n);
+        if (rc == 0 && (n < 1 || n > MAX_RX_DEPTH))
+        {
+            rc = -FI_EINVAL;
+        }
+        cfg->rx_depth = rc ? cfg->rx_depth : n;
+    }
+    else if (!strcmp(key, "cq_size"))
+    {
+        rc = parse_size(value, &cfg->cq_size);
+    }
+    else if (!strcmp(key, "eq_size"))
+    {
+        rc = parse_size(value, &cfg->eq_size);
+    }
+    else if (!strcmp(key, "idle_timeout"))
+    {
+        rc = parse_size(value, &n);
+        cfg->idle_timeout = rc ? cfg->idle_timeout : n;
+    }
+    else if (!strcmp(key, "imm_data"))
+    {
+        rc = parse_size(value, &n);
+        cfg->imm_data = rc ? cfg->imm_data : n != 0;
+    }
+    else if (!strcmp(key, "verify"))
+    {
+        rc = parse_size(value, &n);
+        cfg->verify = rc ? cfg->verify : n != 0;
+    }
+    else if (!strcmp(key, "compress_min"))
+    {
+        rc = parse_size(value, &cfg->compress_min);
+    }
+    else if (!strcmp(key, "persist_path"))
+    {
+        snprintf(cfg->persist_path, sizeof(cfg->persist_path), "%s", value);
+    }
+    else if (!strcmp(key, "dataset_path"))
+    {
+        snprintf(cfg->dataset_path, sizeof(cfg->dataset_path), "%s", value);
+    }
+    else if (!strcmp(key, "dataset_populate"))
+    {
+        rc = parse_size(value, &n);
+        cfg->dataset_populate = rc ? cfg->dataset_populate : n != 0;
+    }
+    else if (!strcmp(key, "dataset_hugepages"))
+    {
+        rc = parse_size(value, &n);
+        cfg->dataset_hugepages = rc ? cfg->dataset_hugepages : n != 0;
+    }
+    else if (!strcmp(key, "lease_ms"))
+    {
+        rc = parse_size(value, &n);
+        cfg->lease_ms = rc ? cfg->lease_ms : n;
+    }
+    else if (!strcmp(key, "read_cache_size"))
+    {
+        rc = parse_size(value, &cfg->read_cache_size);
+    }
+    else if (!strcmp(key, "qos_small_max"))
+    {
+        rc = parse_size(value, &cfg->qos_small_max);
+    }
+    else if (!strcmp(key, "qos_bulk_bytes"))
+    {
+        rc = parse_size(value, &cfg->qos_bulk_bytes);
+    }
+    else if (!strcmp(key, "qos_weight"))
+    {
+        rc = parse_size(value, &n);
+        if (rc == 0 && (n < 1 || n > 255))
+        {
+            rc = -FI_EINVAL;
+        }
+        cfg->qos_weight = rc ? cfg->qos_weight : n;
+    }
+    else if (!strcmp(key, "profile"))
+    {
+        rc = parse_size(value, &n);
+        cfg->profile = rc ? cfg->profile : n != 0;
+    }
+    else
+    {
+        rc = -FI_ENOENT;
+        GOTO(err, "unknown config key %s", key);
+    }
+
+    if (rc)
+    {
+        GOTO(err, "bad value for %s: %s", key, value);
+    }
+
+    return 0;
+
+err:
+    return rc;
+}
+
+static char *trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char)*s))
+    {
+        s++;
+    }
+
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+    {
+        *--end = '\0';
+    }
+
+    return s;
+}
+
+int config_load_file(struct net_config *cfg, const char *path)
+{
+    char line[256];
+    int lineno = 0;
+    int rc = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f)
+    {
+        rc = -FI_ENOENT;
+        GOTO(err, "unable to open config file %s", path);
+    }
+
+    while (fgets(line, sizeof(line), f))
+    {
+        char *comment = strchr(line, '#');
+        char *key = line;
+        char *value;
+
+        lineno++;
+        if (comment)
+        {
+            *comment = '\0';
+        }
+
+        value = strchr(line, '=');
+        if (!value)
+        {
+            if (*trim(line))
+            {
+                fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+                rc = -FI_EINVAL;
+            }
+            continue;
+        }
+        *value++ = '\0';
+
+        if (config_set(cfg, trim(key), trim(value)) < 0)
+        {
+            fprintf(stderr, "%s:%d: ignoring line\n", path, lineno);
+            rc = -FI_EINVAL;
+        }
+    }
+
+    fclose(f);
+
+err:
+    return rc;
+}
+
+int config_load_env(struct net_config *cfg)
+{
+    static const char *keys[] = {"provider",     "addr",     "port",    "ep_type",
+                                 "mr_mode",      "rx_depth", "cq_size", "eq_size",
+                                 "idle_timeout", "imm_data", "verify",  "compress_min",
+                                 "persist_path", "dataset_path", "dataset_populate",
+                                 "dataset_hugepages", "lease_ms", "read_cache_size",
+                                 "qos_small_max", "qos_bulk_bytes", "qos_weight",
+                                 "profile"};
+    int rc = 0;
+
+    for (int i = 0; i < sizeof(keys) / sizeof(*keys); i++)
+    {
+        char name[64];
+        const char *value;
+        int j;
+
+        j = snprintf(name, sizeof(name), "%s", CONFIG_ENV_PREFIX);
+        for (const char *c = keys[i]; *c; c++)
+        {
+            name[j++] = toupper((unsigned char)*c);
+        }
+        name[j] = '\0';
+
+        value = getenv(name);
+        if (value && config_set(cfg, keys[i], value) < 0)
+        {
+            rc = -FI_EINVAL;
+        }
+    }
+
+    return rc;
+}
+
+void config_print(const struct net_config *cfg, FILE *f)
+{
+    fprintf(f, "provider = %s\n", cfg->provider);
+    fprintf(f, "addr = %s\n", cfg->addr);
+    fprintf(f, "port = %u\n", cfg->port);
+    fprintf(f, "ep_type = %s\n",
+            cfg->ep_type == FI_EP_MSG ? "msg" : cfg->ep_type == FI_EP_RDM ? "rdm" : "dgram");
+    fprintf(f, "mr_mode = %s\n", cfg->mr_mode == FI_MR_BASIC ? "basic" : "scalable");
+    fprintf(f, "rx_depth = %d\n", cfg->rx_depth);
+    fprintf(f, "cq_size = %zu\n", cfg->cq_size);
+    fprintf(f, "eq_size = %zu\n", cfg->eq_size);
+    fprintf(f, "idle_timeout = %d\n", cfg->idle_timeout);
+    fprintf(f, "imm_data = %d\n", cfg->imm_data);
+    fprintf(f, "verify = %d\n", cfg->verify);
+    fprintf(f, "compress_min = %zu\n", cfg->compress_min);
+    fprintf(f, "persist_path = %s\n", cfg->persist_path);
+    fprintf(f, "dataset_path = %s\n", cfg->dataset_path);
+    fprintf(f, "dataset_populate = %d\n", cfg->dataset_populate);
+    fprintf(f, "dataset_hugepages = %d\n", cfg->dataset_hugepages);
+    fprintf(f, "lease_ms = %u\n", cfg->lease_ms);
+    fprintf(f, "read_cache_size = %zu\n", cfg->read_cache_size);
+    fprintf(f, "qos_small_max = %zu\n", cfg->qos_small_max);
+    fprintf(f, "qos_bulk_bytes = %zu\n", cfg->qos_bulk_bytes);
+    fprintf(f, "qos_weight = %u\n", cfg->qos_weight);
+    fprintf(f, "profile = %d\n", cfg->profile);
+}
@@ -0,0 +1,201 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "crc32c.h"
+
+// reflected Castagnoli polynomial
+#define POLY 0x82f63b78
+
+// bytes per lane of the interleaved hardware loop, buffers shorter than three lanes run serially
+#define LANE 4096
+
+static uint32_t crc_table[8][256];
+// x^(2^k) mod P, for shifting a crc past runs of zeros
+static uint32_t x2n_table[32];
+static uint32_t lane_shift;
+
+static uint32_t (*crc32c_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+static const char *impl_name;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+// a * b mod P, both reflected
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t p = 0;
+
+    while (true)
+    {
+        if (a & m)
+        {
+            p ^= b;
+            if ((a & (m - 1)) == 0)
+            {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// x^(n * 2^k) mod P
+static uint32_t x2nmodp(size_t n, unsigned k)
+{
+    uint32_t p = 1u << 31;
+
+    while (n)
+    {
+        if (n & 1)
+        {
+            p = multmodp(x2n_table[k & 31], p);
+        }
+        n >>= 1;
+        k++;
+    }
+
+    return p;
+}
+
+// slicing by 8
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+    while (len && ((uintptr_t)p & 7))
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+
+    while (len >= 8)
+    {
+        uint64_t word;
+
+        memcpy(&word, p, sizeof(word));
+        word ^= crc;
+        crc = crc_table[7][word & 0xff] ^ crc_table[6][(word >> 8) & 0xff] ^
+              crc_table[5][(word >> 16) & 0xff] ^ crc_table[4][(word >> 24) & 0xff] ^
+              crc_table[3][(word >> 32) & 0xff] ^ crc_table[2][(word >> 40) & 0xff] ^
+              crc_table[1][(word >> 48) & 0xff] ^ crc_table[0][word >> 56];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+    {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#if defined(__x86_64__)
+/*
+The crc32 instruction has a latency of three cycles but a throughput of one, so three
+independent lanes keep it busy. Each lane starts from zero and the results are stitched
+together by shifting the running crc past the next lane's length.
+*/
+__attribute__((target("sse4.2"))) static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p,
+                                                           size_t len)
+{
+    uint64_t c0 = crc;
+
+    while (len && ((uintptr_t)p & 7))
+    {
+        c0 = _mm_crc32_u8(c0, *p++);
+        len--;
+    }
+
+    while (len >= 3 * LANE)
+    {
+        uint64_t c1 = 0;
+        uint64_t c2 = 0;
+
+        for (size_t i = 0; i < LANE; i += 8)
+        {
+            c0 = _mm_crc32_u64(c0, *(const uint64_t *)(p + i));
+            c1 = _mm_crc32_u64(c1, *(const uint64_t *)(p + LANE + i));
+            c2 = _mm_crc32_u64(c2, *(const uint64_t *)(p + 2 * LANE + i));
+        }
+
+        c0 = multmodp(lane_shift, c0) ^ c1;
+        c0 = multmodp(lane_shift, c0) ^ c2;
+        p += 3 * LANE;
+        len -= 3 * LANE;
+    }
+
+    while (len >= 8)
+    {
+        c0 = _mm_crc32_u64(c0, *(const uint64_t *)p);
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--)
+    {
+        c0 = _mm_crc32_u8(c0, *p++);
+    }
+
+    return c0;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+
+        for (int j = 0; j < 8; j++)
+        {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        crc_table[0][i] = crc;
+    }
+
+    for (int i = 0; i < 256; i++)
+    {
+        for (int j = 1; j < 8; j++)
+        {
+            crc_table[j][i] = crc_table[0][crc_table[j - 1][i] & 0xff] ^ (crc_table[j - 1][i] >> 8);
+        }
+    }
+
+    // x^1, then repeated squaring
+    x2n_table[0] = 1u << 30;
+    for (int k = 1; k < 32; k++)
+    {
+        x2n_table[k] = multmodp(x2n_table[k - 1], x2n_table[k - 1]);
+    }
+    lane_shift = x2nmodp(LANE, 3);
+
+    crc32c_fn = crc32c_sw;
+    impl_name = "table";
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        crc32c_fn = crc32c_hw;
+        impl_name = "sse4.2";
+    }
+#endif
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&init_once, crc32c_init);
+
+    return ~crc32c_fn(~crc, buf, len);
+}
+
+const char *crc32c_impl(void)
+{
+    pthread_once(&init_once, crc32c_init);
+
+    return impl_name;
+}
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "fault.h"
+
+bool fault_enabled = false;
+
+static unsigned fault_ppm[FAULT_TYPES];
+static uint64_t fault_hits[FAULT_TYPES];
+static uint64_t fault_state = 1;
+
+static const char *fault_names[FAULT_TYPES] = {"eagain", "delay", "cq_error", "shutdown"};
+
+void fault_set(enum fault_type type, unsigned ppm)
+{
+    fault_ppm[type] = ppm;
+
+    fault_enabled = false;
+    for (int i = 0; i < FAULT_TYPES; i++)
+    {
+        fault_enabled |= fault_ppm[i] != 0;
+    }
+}
+
+void fault_clear(void)
+{
+    memset(fault_ppm, 0, sizeof(fault_ppm));
+    memset(fault_hits, 0, sizeof(fault_hits));
+    fault_enabled = false;
+}
+
+void fault_seed(uint64_t seed)
+{
+    // xorshift can't leave zero
+    fault_state = seed ? seed : 1;
+}
+
+// xorshift64*
+static uint64_t fault_next(void)
+{
+    fault_state ^= fault_state >> 12;
+    fault_state ^= fault_state << 25;
+    fault_state ^= fault_state >> 27;
+
+    return fault_state * 0x2545f4914f6cdd1dULL;
+}
+
+bool fault_hit(enum fault_type type)
+{
+    if (!fault_enabled || !fault_ppm[type] || (fault_next() >> 32) % 1000000 >= fault_ppm[type])
+    {
+        return false;
+    }
+
+    fault_hits[type]++;
+
+    return true;
+}
+
+uint64_t fault_count(enum fault_type type)
+{
+    return fault_hits[type];
+}
+
+const char *fault_name(enum fault_type type)
+{
+    return fault_names[type];
+}
@@ -0,0 +1,126 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rdma/fi_errno.h>
+
+#include "hash_ring.h"
+#include "log.h"
+
+// splitmix64 finalizer, neighbouring keys end up far apart on the ring
+uint64_t ring_hash(uint64_t key)
+{
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+
+    return key;
+}
+
+// FNV-1a
+static uint64_t hash_name(const char *name, int vnode)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (const char *c = name; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+    }
+
+    return ring_hash(hash ^ (uint64_t)vnode);
+}
+
+static int node_cmp(const void *a, const void *b)
+{
+    const struct ring_node *na = a;
+    const struct ring_node *nb = b;
+
+    if (na->hash != nb->hash)
+    {
+        return na->hash < nb->hash ? -1 : 1;
+    }
+
+    // equal hashes still need a stable order
+    return na->server - nb->server;
+}
+
+int ring_init(struct hash_ring *ring, const char **names, int server_count, int vnodes)
+{
+    int rc;
+
+    ring->node_count = server_count * vnodes;
+    ring->server_count = server_count;
+    ring->nodes = calloc(ring->node_count, sizeof(*ring->nodes));
+    if (!ring->nodes)
+    {
+        rc = -FI_ENOMEM;
+        GOTO(err, "allocating %d ring nodes", ring->node_count);
+    }
+
+    for (int i = 0; i < server_count; i++)
+    {
+        for (int j = 0; j < vnodes; j++)
+        {
+            ring->nodes[i * vnodes + j].hash = hash_name(names[i], j);
+            ring->nodes[i * vnodes + j].server = i;
+        }
+    }
+
+    qsort(ring->nodes, ring->node_count, sizeof(*ring->nodes), node_cmp);
+
+    return 0;
+
+err:
+    return rc;
+}
+
+void ring_free(struct hash_ring *ring)
+{
+    free(ring->nodes);
+    ring->nodes = NULL;
+    ring->node_count = 0;
+}
+
+int ring_lookup(const struct hash_ring *ring, uint64_t key, int *replica)
+{
+    uint64_t hash = ring_hash(key);
+    int lo = 0;
+    int hi = ring->node_count;
+    int server;
+
+    // first node at or after hash, wrapping to the start
+    while (lo < hi)
+    {
+        int mid = lo + (hi - lo) / 2;
+
+        if (ring->nodes[mid].hash < hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+
+    lo %= ring->node_count;
+    server = ring->nodes[lo].server;
+
+    if (replica)
+    {
+        *replica = -1;
+        for (int i = 1; i < ring->node_count; i++)
+        {
+            int next = ring->nodes[(lo + i) % ring->node_count].server;
+
+            if (next != server)
+            {
+                *replica = next;
+                break;
+            }
+        }
+    }
+
+    return server;
+}
@@ -0,0 +1,227 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <rdma/fi_errno.h>
+
+#include "lz.h"
+
+/*
+Each sequence is a token byte, literal length in the high nibble and match length - LZ_MIN_MATCH
+in the low one, either nibble at 15 continuing in following bytes that add up until one is under
+255. Then the literals, and the match offset as two little endian bytes. The last sequence has
+no match, it ends at the end of the block.
+*/
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+// after every 2^LZ_SKIP_SHIFT misses in a row the search step grows by one
+#define LZ_SKIP_SHIFT 5
+
+static uint32_t read32(const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy(&v, p, sizeof(v));
+
+    return v;
+}
+
+static uint32_t lz_hash(uint32_t v)
+{
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t n)
+{
+    while (n >= 255)
+    {
+        if (op >= oend)
+        {
+            return NULL;
+        }
+        *op++ = 255;
+        n -= 255;
+    }
+
+    if (op >= oend)
+    {
+        return NULL;
+    }
+    *op++ = n;
+
+    return op;
+}
+
+// match_len 0 for the final literals, returns NULL when out of room
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit, size_t lit_len,
+                             size_t offset, size_t match_len)
+{
+    size_t ml = match_len ? match_len - LZ_MIN_MATCH : 0;
+    uint8_t *token = op;
+
+    if (op >= oend)
+    {
+        return NULL;
+    }
+    op++;
+    *token = (lit_len < 15 ? lit_len : 15) << 4 | (ml < 15 ? ml : 15);
+
+    if (lit_len >= 15 && !(op = put_length(op, oend, lit_len - 15)))
+    {
+        return NULL;
+    }
+
+    if (lit_len > (size_t)(oend - op))
+    {
+        return NULL;
+    }
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+
+    if (match_len)
+    {
+        if (oend - op < 2)
+        {
+            return NULL;
+        }
+        *op++ = offset;
+        *op++ = offset >> 8;
+
+        if (ml >= 15 && !(op = put_length(op, oend, ml - 15)))
+        {
+            return NULL;
+        }
+    }
+
+    return op;
+}
+
+size_t lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *in = src;
+    const uint8_t *iend = in + len;
+    const uint8_t *ip = in;
+    const uint8_t *anchor = in;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+    // positions in src, a stale or colliding entry is caught by comparing the bytes
+    uint32_t table[1 << LZ_HASH_BITS];
+    unsigned misses = 0;
+
+    memset(table, 0, sizeof(table));
+
+    while (iend - ip >= LZ_MIN_MATCH)
+    {
+        uint32_t h = lz_hash(read32(ip));
+        const uint8_t *ref = in + table[h];
+
+        table[h] = ip - in;
+
+        if (ref < ip && ip - ref <= LZ_MAX_OFFSET && read32(ref) == read32(ip))
+        {
+            size_t ml = LZ_MIN_MATCH;
+
+            while (ip + ml < iend && ref[ml] == ip[ml])
+            {
+                ml++;
+            }
+
+            op = put_sequence(op, oend, anchor, ip - anchor, ip - ref, ml);
+            if (!op)
+            {
+                return 0;
+            }
+
+            ip += ml;
+            anchor = ip;
+            misses = 0;
+        }
+        else
+        {
+            ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+
+    return op ? op - (uint8_t *)dst : 0;
+}
+
+static bool get_length(const uint8_t **ip, const uint8_t *iend, size_t *n)
+{
+    uint8_t b;
+
+    do
+    {
+        if (*ip >= iend)
+        {
+            return false;
+        }
+        b = *(*ip)++;
+        *n += b;
+    } while (b == 255);
+
+    return true;
+}
+
+ssize_t lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+    const uint8_t *ip = src;
+    const uint8_t *iend = ip + len;
+    uint8_t *op = dst;
+    uint8_t *oend = op + cap;
+
+    while (ip < iend)
+    {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        size_t ml = token & 15;
+        size_t offset;
+
+        if (lit_len == 15 && !get_length(&ip, iend, &lit_len))
+        {
+            return -FI_EINVAL;
+        }
+
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op))
+        {
+            return -FI_EINVAL;
+        }
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+
+        if (ip == iend)
+        {
+            break;
+        }
+
+        if (iend - ip < 2)
+        {
+            return -FI_EINVAL;
+        }
+        offset = ip[0] | ip[1] << 8;
+        ip += 2;
+
+        if (ml == 15 && !get_length(&ip, iend, &ml))
+        {
+            return -FI_EINVAL;
+        }
+        ml += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > (size_t)(op - (uint8_t *)dst) || ml > (size_t)(oend - op))
+        {
+            return -FI_EINVAL;
+        }
+
+        // matches may overlap what they produce
+        for (const uint8_t *ref = op - offset; ml; ml--)
+        {
+            *op++ = *ref++;
+        }
+    }
+
+    return op - (uint8_t *)dst;
+}
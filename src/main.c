@@ -1,16 +1,226 @@
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
+#include <rdma/fi_errno.h>
+
+#include "client_pool.h"
+#include "config.h"
 #include "mem.h"
 #include "network.h"
 
-int main(int argc, const char **argv)
+// "addr[:port],addr[:port],...", entries without a port use default_port. Modifies list
+static int parse_servers(char *list, unsigned short default_port, struct client_server *servers)
+{
+    int count = 0;
+
+    for (char *entry = strtok(list, ","); entry; entry = strtok(NULL, ","))
+    {
+        char *port = strchr(entry, ':');
+
+        if (count == MAX_POOL_SERVERS)
+        {
+            fprintf(stderr, "too many servers, max %d\n", MAX_POOL_SERVERS);
+            return -1;
+        }
+
+        if (port)
+        {
+            *port++ = '\0';
+        }
+        servers[count].addr = entry;
+        servers[count].port = port ? atoi(port) : default_port;
+        count++;
+    }
+
+    return count;
+}
+
+static const char *layout_names[] = {"contiguous", "striped", "hashed", "replicated"};
+
+// every option sets the config key of the same name
+static const struct option config_options[] = {
+    {"provider", required_argument, NULL, 0}, {"addr", required_argument, NULL, 0},
+    {"port", required_argument, NULL, 0},     {"ep_type", required_argument, NULL, 0},
+    {"mr_mode", required_argument, NULL, 0},  {"rx_depth", required_argument, NULL, 0},
+    {"cq_size", required_argument, NULL, 0},  {"eq_size", required_argument, NULL, 0},
+    {"imm_data", required_argument, NULL, 0}, {"idle_timeout", required_argument, NULL, 0},
+    {"verify", required_argument, NULL, 0},   {"compress_min", required_argument, NULL, 0},
+    {"persist_path", required_argument, NULL, 0}, {"dataset_path", required_argument, NULL, 0},
+    {"dataset_populate", required_argument, NULL, 0},
+    {"dataset_hugepages", required_argument, NULL, 0},
+    {"lease_ms", required_argument, NULL, 0}, {"read_cache_size", required_argument, NULL, 0},
+    {"qos_small_max", required_argument, NULL, 0}, {"qos_bulk_bytes", required_argument, NULL, 0},
+    {"qos_weight", required_argument, NULL, 0}, {"profile", required_argument, NULL, 0},
+    {"config", required_argument, NULL, 'c'}, {NULL, 0, NULL, 0},
+};
+
+// defaults, then the config file, the environment and the command line options
+static int load_config(struct net_config *cfg, int argc, char **argv)
+{
+    const char *path = getenv(CONFIG_FILE_ENV);
+    char *cli_args[sizeof(config_options) / sizeof(*config_options)] = {NULL};
+    int opt, idx;
+
+    while ((opt = getopt_long(argc, argv, "c:", config_options, &idx)) != -1)
+    {
+        if (opt == 'c')
+        {
+            path = optarg;
+        }
+        else if (opt == 0)
+        {
+            cli_args[idx] = optarg;
+        }
+        else
+        {
+            return -FI_EINVAL;
+        }
+    }
+
+    config_defaults(cfg);
+
+    if (path && config_load_file(cfg, path) < 0)
+    {
+        return -FI_EINVAL;
+    }
+
+    if (config_load_env(cfg) < 0)
+    {
+        return -FI_EINVAL;
+    }
+
+    for (int i = 0; config_options[i].name; i++)
+    {
+        if (cli_args[i] && config_set(cfg, config_options[i].name, cli_args[i]) < 0)
+        {
+            return -FI_EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*
+usage: libfab-test [options] [mode] ...
+       libfab-test                                  client demo against 127.0.0.1:1701
+       libfab-test client [addr] [port]             client demo
+       libfab-test pool [servers] [port] [threads] [layout]
+                                                    client library demo, servers is a comma
+                                                    separated list of addr[:port], layout one of
+                                                    layout_names, default striped
+       libfab-test local [addr] [port]              shared memory path against the fabric to
+                                                    a server on this host
+       libfab-test probe [len] [out]                time len byte ops over each provider, write
+                                                    the fastest as a config file to out
+       libfab-test selftest [port]                  fork servers on the ports after port and
+                                                    run the pool against them under injected
+                                                    faults
+       libfab-test server [port]                    server
+       libfab-test <anything else>                  server on the configured port
+
+options: --config FILE, or $LIBFAB_TEST_CONFIG, then --provider, --addr, --port, --ep_type
+         (msg), --mr_mode (scalable|basic), --rx_depth, --cq_size, --eq_size, --imm_data (0|1),
+         --idle_timeout (seconds), --verify (0|1), --compress_min (bytes), --persist_path
+         (file), --dataset_path (file), --dataset_populate (0|1), --dataset_hugepages (0|1),
+         --lease_ms (ms), --read_cache_size (bytes), --qos_small_max (bytes), --qos_bulk_bytes
+         (bytes), --qos_weight (1-255), --profile (0|1), then kill -USR1 a server to dump
+         its cycle accounting.
+         Each can also be set with $LIBFAB_TEST_<NAME>, options win over the environment,
+         which wins over the file
+*/
+int main(int argc, char **argv)
 {
     struct net_info net;
-    bool is_server = argc > 1;
+    struct net_config cfg;
+    const char *mode;
+    bool is_server;
     int rc;
 
-    rc = init_network(&net, is_server);
+    if (load_config(&cfg, argc, argv) < 0)
+    {
+        fprintf(stderr, "Bad configuration\n");
+
+        return 1;
+    }
+
+    // the positional arguments
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    mode = argc > 1 ? argv[1] : "client";
+    is_server = strcmp(mode, "client") && strcmp(mode, "pool") && strcmp(mode, "probe") &&
+                strcmp(mode, "local") && strcmp(mode, "selftest");
+
+    if (!strcmp(mode, "server") || !strcmp(mode, "selftest"))
+    {
+        if (argc > 2)
+        {
+            config_set(&cfg, "port", argv[2]);
+        }
+    }
+    else if (!strcmp(mode, "client") || !strcmp(mode, "pool") || !strcmp(mode, "local"))
+    {
+        if (argc > 2)
+        {
+            config_set(&cfg, "addr", argv[2]);
+        }
+        if (argc > 3)
+        {
+            config_set(&cfg, "port", argv[3]);
+        }
+    }
+
+    if (!strcmp(mode, "probe"))
+    {
+        return run_probe(&cfg, argc > 2 ? strtoul(argv[2], NULL, 0) : BULK_SIZE,
+                         argc > 3 ? argv[3] : NULL)
+                   ? 1
+                   : 0;
+    }
+
+    if (!strcmp(mode, "selftest"))
+    {
+        return run_selftest(&cfg);
+    }
+
+    if (!strcmp(mode, "local"))
+    {
+        struct client_server server = {.addr = cfg.addr, .port = cfg.port};
+
+        return run_local_bench(&cfg, &server) ? 1 : 0;
+    }
+
+    if (!strcmp(mode, "pool"))
+    {
+        struct client_server servers[MAX_POOL_SERVERS];
+        char *list = strdup(cfg.addr);
+        int count = parse_servers(list, cfg.port, servers);
+        int layout = LAYOUT_STRIPED;
+
+        for (int i = 0; argc > 5 && i < sizeof(layout_names) / sizeof(*layout_names); i++)
+        {
+            if (!strcmp(argv[5], layout_names[i]))
+            {
+                layout = i;
+            }
+        }
+
+        // the pool sets up its own network, so the server list mustn't reach getinfo.
+        // replicated is the hashed layout plus replication
+        snprintf(cfg.addr, sizeof(cfg.addr), "%s", count > 0 ? servers[0].addr : DEFAULT_ADDR);
+        rc = count > 0 ? run_pool_client(&cfg, servers, count, argc > 4 ? atoi(argv[4]) : 4,
+                                         layout > LAYOUT_HASHED ? LAYOUT_HASHED : layout,
+                                         layout > LAYOUT_HASHED)
+                       : -1;
+        free(list);
+
+        return rc ? 1 : 0;
+    }
+
+    rc = init_network(&net, is_server, &cfg);
     if (rc < 0)
     {
         fprintf(stderr, "Unable to initialize fabric");
@@ -34,7 +244,7 @@ int main(int argc, const char **argv)
     }
     else
     {
-        init_client(&net);
+        rc = init_client(&net);
         if (rc < 0)
         {
             fprintf(stderr, "Unable to initialize client");
@@ -42,7 +252,7 @@ int main(int argc, const char **argv)
             return rc;
         }
 
-        run_client(&net, "127.0.0.1", 1701);
+        run_client(&net, cfg.addr, cfg.port);
         close_client(&net);
     }
 
@@ -1,21 +1,32 @@
 #include "mem.h"
 #include "log.h"
 #include "network.h"
+#include "persist.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <rdma/fi_domain.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 // fi_mr_reg require that requested key be different for each region
 #define BULK_KEY 0
 #define CMD_KEY 1
+#define STORE_KEY 2
+#define CACHE_KEY 3
 
 #define GET_BIT(bmap, pos) ((bmap) & (1 << ((pos) % 8)))
-#define SET_BIT(bmap, pos) ((bmap) | (1 << ((pos) % 8)))
-#define CLR_BIT(bmap, pos) ((bmap) & ~(1 << ((pos) % 8)))
+#define SET_BIT(bmap, pos) ((bmap) |= (1 << ((pos) % 8)))
+#define CLR_BIT(bmap, pos) ((bmap) &= ~(1 << ((pos) % 8)))
 
-uint8_t bulk_free_bitmap[MAX_CONNECTIONS];
-uint8_t cmd_free_bitmap[MAX_CONNECTIONS];
+#define BITMAP_BYTES(count) (((count) + 7) / 8)
+
+uint8_t bulk_free_bitmap[BITMAP_BYTES(MAX_CONNECTIONS)];
+uint8_t cmd_free_bitmap[BITMAP_BYTES(CMD_BUF_COUNT)];
 
 void *bulk_bufs = NULL;
 void *cmd_bufs = NULL;
@@ -23,17 +34,40 @@ void *cmd_bufs = NULL;
 struct fid_mr *bulk_mr;
 struct fid_mr *cmd_mr;
 
+void *store_buf = NULL;
+size_t store_size = 0;
+struct fid_mr *store_mr = NULL;
+// the store lives in a shared memory object same-host clients can map
+char store_shm_name[32] = "";
+// the store is a mapped dataset file, see map_dataset
+bool store_is_dataset = false;
+bool store_read_only = false;
+// per LEASE_BLOCK of the store, only kept by a leasing server. A block's version changes with
+// every write to it, and writers counts the writes still landing in it
+uint32_t *store_versions = NULL;
+uint16_t *store_writers = NULL;
+
+// client only, the read cache's blocks
+void *cache_buf = NULL;
+size_t cache_size = 0;
+struct fid_mr *cache_mr = NULL;
+
+// FI_MR_BASIC domains address registered memory by virtual address instead of offset
+bool mr_virt_addr = false;
+
 int init_memory(struct net_info *ni)
 {
     int rc;
 
-    size_t cmd_buf_size = (sizeof(struct network_cmd) * MAX_CONNECTIONS);
+    size_t cmd_buf_size = (sizeof(struct network_cmd) * CMD_BUF_COUNT);
+
+    mr_virt_addr = ni->fi->domain_attr->mr_mode == FI_MR_BASIC;
 
     bulk_bufs = calloc(MAX_CONNECTIONS, BULK_SIZE);
-    cmd_bufs = calloc(MAX_CONNECTIONS, sizeof(struct network_cmd));
+    cmd_bufs = calloc(CMD_BUF_COUNT, sizeof(struct network_cmd));
 
-    memset(bulk_free_bitmap, 0, MAX_CONNECTIONS);
-    memset(cmd_free_bitmap, 0, MAX_CONNECTIONS);
+    memset(bulk_free_bitmap, 0, sizeof(bulk_free_bitmap));
+    memset(cmd_free_bitmap, 0, sizeof(cmd_free_bitmap));
 
     rc = fi_mr_reg(ni->domain, bulk_bufs, BULK_SIZE * MAX_CONNECTIONS,
                    FI_SEND | FI_RECV | FI_READ | FI_WRITE | FI_REMOTE_READ | FI_REMOTE_WRITE, 0, 0,
@@ -66,6 +100,389 @@ err:
     return rc;
 }
 
+static void shm_name(char *name, size_t len, unsigned short port)
+{
+    snprintf(name, len, "/libfab-test-%u", port);
+}
+
+// page aligned, for O_DIRECT writes straight from the store
+static void *alloc_private_store(size_t size)
+{
+    void *buf = aligned_alloc(PERSIST_PAGE, size);
+
+    if (buf)
+    {
+        memset(buf, 0, size);
+    }
+
+    return buf;
+}
+
+// backed by a shared memory object when possible and shared is set, so local clients can bypass
+// the fabric
+static void *alloc_store(unsigned short port, size_t size, bool shared)
+{
+    void *buf;
+    int fd;
+
+    if (!shared)
+    {
+        return alloc_private_store(size);
+    }
+
+    shm_name(store_shm_name, sizeof(store_shm_name), port);
+    fd = shm_open(store_shm_name, O_CREAT | O_TRUNC | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, size) < 0)
+    {
+        fprintf(stderr, "no shared store, local clients will use the fabric\n");
+        if (fd >= 0)
+        {
+            close(fd);
+            shm_unlink(store_shm_name);
+        }
+        store_shm_name[0] = '\0';
+
+        return alloc_private_store(size);
+    }
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        shm_unlink(store_shm_name);
+        store_shm_name[0] = '\0';
+
+        return alloc_private_store(size);
+    }
+
+    return buf;
+}
+
+/*
+A dataset file mapped as the store, so commands and one-sided reads are served straight from the
+page cache. It's shared with the file, a file we can't write is mapped read only and every
+command that would store into it is refused.
+*/
+static void *map_dataset(const struct net_config *cfg, size_t *size)
+{
+    int prot = PROT_READ | PROT_WRITE;
+    int flags = MAP_SHARED | (cfg->dataset_populate ? MAP_POPULATE : 0);
+    int fd = open(cfg->dataset_path, O_RDWR);
+    struct stat st;
+    void *buf;
+
+    if (fd < 0 && (errno == EACCES || errno == EROFS))
+    {
+        fd = open(cfg->dataset_path, O_RDONLY);
+        prot = PROT_READ;
+    }
+
+    if (fd < 0)
+    {
+        fprintf(stderr, "unable to open dataset %s: %s\n", cfg->dataset_path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "dataset %s is empty\n", cfg->dataset_path);
+        close(fd);
+        return NULL;
+    }
+
+    buf = mmap(NULL, st.st_size, prot, flags, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        fprintf(stderr, "unable to map dataset %s: %s\n", cfg->dataset_path, strerror(errno));
+        return NULL;
+    }
+
+    // hugetlbfs files are always mapped with huge pages, for others it's up to the kernel's
+    // transparent huge page support for the filesystem
+    if (cfg->dataset_hugepages && madvise(buf, st.st_size, MADV_HUGEPAGE) < 0)
+    {
+        fprintf(stderr, "no transparent huge pages for %s: %s\n", cfg->dataset_path,
+                strerror(errno));
+    }
+
+    store_is_dataset = true;
+    store_read_only = !(prot & PROT_WRITE);
+    *size = st.st_size;
+
+    return buf;
+}
+
+static void free_store(void *buf, size_t size)
+{
+    if (store_is_dataset)
+    {
+        munmap(buf, size);
+        store_is_dataset = false;
+        store_read_only = false;
+    }
+    else if (store_shm_name[0])
+    {
+        munmap(buf, size);
+        shm_unlink(store_shm_name);
+        store_shm_name[0] = '\0';
+    }
+    else
+    {
+        free(buf);
+    }
+}
+
+int init_store(struct net_info *ni, size_t size)
+{
+    // a read only store is only ever the source of RMA writes and the target of remote reads
+    uint64_t access = FI_WRITE | FI_REMOTE_READ;
+    int rc;
+
+    if (ni->cfg.dataset_path[0])
+    {
+        if (ni->cfg.persist_path[0])
+        {
+            rc = -FI_EINVAL;
+            GOTO(err, "a dataset store is already backed by its file, drop persist_path");
+        }
+
+        store_buf = map_dataset(&ni->cfg, &size);
+    }
+    else
+    {
+        // a persisted or leasing store has to see every write, so it isn't handed to same-host
+        // clients
+        store_buf = alloc_store(ni->cfg.port, size,
+                                !ni->cfg.persist_path[0] && !ni->cfg.lease_ms);
+    }
+
+    if (!store_buf)
+    {
+        rc = -FI_ENOMEM;
+        GOTO(err, "unable to allocate %zu byte store", size);
+    }
+
+    if (!store_read_only)
+    {
+        access |= FI_READ | FI_REMOTE_WRITE;
+    }
+
+    rc = fi_mr_reg(ni->domain, store_buf, size, access, 0, STORE_KEY, 0, &store_mr, NULL);
+    if (rc < 0)
+    {
+        FI_GOTO(err1, "fi_mr_reg");
+    }
+
+    if (ni->cfg.persist_path[0])
+    {
+        rc = persist_open(ni->cfg.persist_path, store_buf, size);
+        if (rc < 0)
+        {
+            GOTO(err2, "persist_open");
+        }
+    }
+
+    if (ni->cfg.lease_ms)
+    {
+        size_t blocks = (size + LEASE_BLOCK - 1) / LEASE_BLOCK;
+
+        store_versions = malloc(blocks * sizeof(*store_versions));
+        store_writers = calloc(blocks, sizeof(*store_writers));
+        if (!store_versions || !store_writers)
+        {
+            rc = -FI_ENOMEM;
+            GOTO(err3, "unable to allocate store versions");
+        }
+
+        for (size_t i = 0; i < blocks; i++)
+        {
+            store_versions[i] = 1;
+        }
+    }
+
+    store_size = size;
+    ni->local_keys.store_key = fi_mr_key(store_mr);
+    ni->local_keys.store_addr = mr_virt_addr ? (uintptr_t)store_buf : 0;
+    ni->local_keys.host_id = store_shm_name[0] ? get_host_id() : 0;
+
+    printf("registered store %p, %zu bytes, key %llu%s%s\n", store_buf, size,
+           fi_mr_key(store_mr), store_shm_name[0] ? ", shared as " : "", store_shm_name);
+    if (store_is_dataset)
+    {
+        printf("store is dataset %s%s\n", ni->cfg.dataset_path,
+               store_read_only ? ", read only" : "");
+    }
+
+    return 0;
+
+err3:
+    free(store_versions);
+    free(store_writers);
+    store_versions = NULL;
+    store_writers = NULL;
+    persist_close();
+err2:
+    fi_close((fid_t)store_mr);
+    store_mr = NULL;
+err1:
+    free_store(store_buf, size);
+    store_buf = NULL;
+err:
+    return rc;
+}
+
+void close_store(struct net_info *ni)
+{
+    persist_close();
+
+    free(store_versions);
+    free(store_writers);
+    store_versions = NULL;
+    store_writers = NULL;
+
+    if (store_mr)
+    {
+        fi_close((fid_t)store_mr);
+        store_mr = NULL;
+    }
+
+    if (store_buf)
+    {
+        free_store(store_buf, store_size);
+    }
+    store_buf = NULL;
+    store_size = 0;
+    ni->local_keys.host_id = 0;
+}
+
+bool store_leases()
+{
+    return store_versions != NULL;
+}
+
+void store_write_begin(uint64_t offset, size_t len)
+{
+    if (!store_versions || !len)
+    {
+        return;
+    }
+
+    for (uint64_t i = offset / LEASE_BLOCK; i <= (offset + len - 1) / LEASE_BLOCK; i++)
+    {
+        store_writers[i]++;
+    }
+}
+
+void store_write_end(uint64_t offset, size_t len)
+{
+    if (!store_versions || !len)
+    {
+        return;
+    }
+
+    for (uint64_t i = offset / LEASE_BLOCK; i <= (offset + len - 1) / LEASE_BLOCK; i++)
+    {
+        store_writers[i]--;
+        // 0 is never a version, it tells the client not to cache
+        if (++store_versions[i] == 0)
+        {
+            store_versions[i] = 1;
+        }
+    }
+}
+
+uint32_t store_version(uint64_t offset)
+{
+    uint64_t i = offset / LEASE_BLOCK;
+
+    if (!store_versions || store_writers[i])
+    {
+        return 0;
+    }
+
+    return store_versions[i];
+}
+
+void *alloc_cache_mem(struct net_info *ni, size_t size)
+{
+    int rc;
+
+    cache_buf = aligned_alloc(LEASE_BLOCK, size);
+    if (!cache_buf)
+    {
+        return NULL;
+    }
+
+    // only ever the target of the server's RMA writes
+    rc = fi_mr_reg(ni->domain, cache_buf, size, FI_READ | FI_WRITE | FI_REMOTE_WRITE, 0,
+                   CACHE_KEY, 0, &cache_mr, NULL);
+    if (rc < 0)
+    {
+        fprintf(stderr, "fi_mr_reg for the read cache: %s\n", fi_strerror(-rc));
+        free(cache_buf);
+        cache_buf = NULL;
+        return NULL;
+    }
+
+    cache_size = size;
+    printf("registered read cache %p, %zu bytes, key %llu\n", cache_buf, size,
+           fi_mr_key(cache_mr));
+
+    return cache_buf;
+}
+
+void free_cache_mem(void *buf)
+{
+    if (!buf)
+    {
+        return;
+    }
+
+    fi_close((fid_t)cache_mr);
+    cache_mr = NULL;
+    free(cache_buf);
+    cache_buf = NULL;
+    cache_size = 0;
+}
+
+void *open_shared_store(unsigned short port, size_t *size)
+{
+    char name[32];
+    struct stat st;
+    void *buf;
+    int fd;
+
+    shm_name(name, sizeof(name), port);
+    fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+    {
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size == 0)
+    {
+        close(fd);
+        return NULL;
+    }
+
+    buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (buf == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    *size = st.st_size;
+
+    return buf;
+}
+
+void close_shared_store(void *store, size_t size)
+{
+    munmap(store, size);
+}
+
 int close_memory(struct net_info *ni)
 {
     fi_close((fid_t)bulk_mr);
@@ -74,15 +491,15 @@ int close_memory(struct net_info *ni)
     free(cmd_bufs);
 }
 
-static int get_free_index(uint8_t *bitmap)
+static int get_free_index(uint8_t *bitmap, int count)
 {
-    for (int i = 0; i < MAX_CONNECTIONS / 8; i++)
+    for (int i = 0; i < BITMAP_BYTES(count); i++)
     {
-        if (!~bitmap[0])
+        if (bitmap[i] == 0xff)
         {
             continue;
         }
-        for (int j = 0; j < 8; j++)
+        for (int j = 0; j < 8 && i * 8 + j < count; j++)
         {
             if (GET_BIT(bitmap[i], j) == 0)
             {
@@ -98,7 +515,7 @@ static int get_free_index(uint8_t *bitmap)
 
 void *alloc_bulk_buf()
 {
-    int index = get_free_index(bulk_free_bitmap);
+    int index = get_free_index(bulk_free_bitmap, MAX_CONNECTIONS);
     if (index == -1)
     {
         return NULL;
@@ -109,7 +526,7 @@ void *alloc_bulk_buf()
 
 void *alloc_cmd_buf()
 {
-    int index = get_free_index(cmd_free_bitmap);
+    int index = get_free_index(cmd_free_bitmap, CMD_BUF_COUNT);
     if (index == -1)
     {
         return NULL;
@@ -120,6 +537,11 @@ void *alloc_cmd_buf()
 
 void free_cmd_buf(void *buf)
 {
+    if (!buf)
+    {
+        return;
+    }
+
     int index = (buf - cmd_bufs) / sizeof(struct network_cmd);
 
     CLR_BIT(cmd_free_bitmap[index / 8], index % 8);
@@ -127,6 +549,11 @@ void free_cmd_buf(void *buf)
 
 void free_bulk_buf(void *buf)
 {
+    if (!buf)
+    {
+        return;
+    }
+
     int index = (buf - bulk_bufs) / BULK_SIZE;
 
     CLR_BIT(bulk_free_bitmap[index / 8], index % 8);
@@ -142,6 +569,11 @@ bool is_bulk_buf(void *buf)
     return (buf - bulk_bufs) < BULK_SIZE * MAX_CONNECTIONS;
 }
 
+bool is_store_read_only()
+{
+    return store_read_only;
+}
+
 bool is_cmd_buf(void *buf)
 {
     if (buf < cmd_bufs)
@@ -149,7 +581,7 @@ bool is_cmd_buf(void *buf)
         return false;
     }
 
-    return (buf - cmd_bufs) < sizeof(struct network_cmd) * MAX_CONNECTIONS;
+    return (buf - cmd_bufs) < sizeof(struct network_cmd) * CMD_BUF_COUNT;
 }
 
 struct fid_mr *get_bulk_mr()
@@ -162,11 +594,59 @@ struct fid_mr *get_cmd_mr()
     return cmd_mr;
 }
 
+struct fid_mr *get_store_mr()
+{
+    return store_mr;
+}
+
+struct fid_mr *get_cache_mr()
+{
+    return cache_mr;
+}
+
+static bool is_store_buf(void *buf)
+{
+    return store_buf && buf >= store_buf && (buf - store_buf) < store_size;
+}
+
+// local descriptor for whichever registered region buf is in
+void *get_buf_desc(void *buf)
+{
+    if (is_store_buf(buf))
+    {
+        return fi_mr_desc(store_mr);
+    }
+    else if (is_cmd_buf(buf))
+    {
+        return fi_mr_desc(cmd_mr);
+    }
+
+    return fi_mr_desc(bulk_mr);
+}
+
 // with scalable memory registration, you need to use the offset from the start of the memory
-// region, not the raw virtual address
+// region, not the raw virtual address. Basic registration wants the virtual address
 uint64_t get_bulk_offset(void *bulk_vaddr)
 {
     assert(bulk_vaddr >= bulk_bufs);
 
-    return bulk_vaddr - bulk_bufs;
-}
\ No newline at end of file
+    return mr_virt_addr ? (uintptr_t)bulk_vaddr : bulk_vaddr - bulk_bufs;
+}
+
+uint64_t get_cache_offset(void *cache_vaddr)
+{
+    assert(cache_vaddr >= cache_buf && cache_vaddr - cache_buf < cache_size);
+
+    return mr_virt_addr ? (uintptr_t)cache_vaddr : cache_vaddr - cache_buf;
+}
+
+// op_addr is an offset into the store, checked against its size
+void *get_store_ptr(uint64_t offset, size_t len)
+{
+    if (offset > store_size || len > store_size - offset)
+    {
+        return NULL;
+    }
+
+    return store_buf + offset;
+}
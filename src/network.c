@@ -1,6 +1,7 @@
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
@@ -8,6 +9,7 @@
 
 #include <rdma/fabric.h>
 #include <rdma/fi_cm.h>
+#include <rdma/fi_atomic.h>
 #include <rdma/fi_domain.h>
 #include <rdma/fi_endpoint.h>
 #include <rdma/fi_rma.h>
@@ -15,6 +17,7 @@
 #include "log.h"
 #include "mem.h"
 #include "network.h"
+#include "prof.h"
 
 static void print_long_info(struct fi_info *info)
 {
@@ -41,26 +44,36 @@ static void print_short_info(struct fi_info *info)
     }
 }
 
-struct fi_info *get_fi(bool is_source)
+struct fi_info *get_fi(bool is_source, const struct net_config *cfg)
 {
     struct fi_info *fi, *hints;
+    char service[8];
     int rc;
 
-    hints = fi_allocinfo();
-    hints->mode = FI_LOCAL_MR;
-    hints->caps = FI_RMA;
-    // hints->ep_attr->type = FI_EP_RDM;
-    hints->ep_attr->type = FI_EP_MSG;
-    // hints->fabric_attr->prov_name = strdup("tcp");
-    hints->fabric_attr->prov_name = strdup("sockets");
+    snprintf(service, sizeof(service), "%u", cfg->port);
 
-    rc = fi_getinfo(FI_VERSION(1, 4), "127.0.0.1", "1701", is_source ? FI_SOURCE : 0, hints, &fi);
+    hints = fi_allocinfo();
+    // FI_RX_CQ_DATA: we can handle RMA immediate data consuming a posted receive
+    hints->mode = FI_LOCAL_MR | FI_RX_CQ_DATA;
+    hints->caps = FI_RMA | FI_ATOMIC;
+    hints->ep_attr->type = cfg->ep_type;
+    hints->domain_attr->mr_mode = cfg->mr_mode;
+    hints->fabric_attr->prov_name = strdup(cfg->provider);
+
+    rc = fi_getinfo(FI_VERSION(1, 4), cfg->addr, service, is_source ? FI_SOURCE : 0, hints, &fi);
+    if (rc == -FI_ENODATA)
+    {
+        // no native atomics, the server will emulate them
+        hints->caps = FI_RMA;
+        rc = fi_getinfo(FI_VERSION(1, 4), cfg->addr, service, is_source ? FI_SOURCE : 0, hints,
+                        &fi);
+    }
 
     fi_freeinfo(hints);
 
     if (rc)
     {
-        GOTO(err, "cannot get fabric info");
+        GOTO(err, "cannot get fabric info for provider %s", cfg->provider);
     }
 
     return fi;
@@ -69,20 +82,59 @@ err:
     return NULL;
 }
 
+// identifies this boot of this host, so a client can tell it shares /dev/shm with the server
+uint64_t get_host_id(void)
+{
+    char boot_id[64] = {0};
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    FILE *f = fopen("/proc/sys/kernel/random/boot_id", "r");
+
+    if (!f || !fgets(boot_id, sizeof(boot_id), f))
+    {
+        snprintf(boot_id, sizeof(boot_id), "%ld", gethostid());
+    }
+    if (f)
+    {
+        fclose(f);
+    }
+
+    for (char *c = boot_id; *c; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001b3ULL;
+    }
+
+    // zero means no shared store
+    return hash ? hash : 1;
+}
+
 void free_fi(struct fi_info *info)
 {
     fi_freeinfo(info);
 }
 
-int init_network(struct net_info *ni, bool is_server)
+int init_network(struct net_info *ni, bool is_server, const struct net_config *cfg)
 {
-    struct fi_wait_attr wait_attr = {.wait_obj = FI_WAIT_UNSPEC};
+    struct fi_wait_attr wait_attr = {0};
     struct fi_eq_attr eq_attr = {
         .wait_obj = FI_WAIT_SET,
     };
+    size_t tx_depth;
     int rc = 0;
 
-    ni->fi = get_fi(is_server);
+    ni->cfg = *cfg;
+    ni->is_server = is_server;
+    ni->cq = NULL;
+    ni->delayed_head = NULL;
+    ni->delayed_tail = NULL;
+
+    // connections are made through a passive endpoint and fi_connect
+    if (cfg->ep_type != FI_EP_MSG)
+    {
+        rc = -FI_EINVAL;
+        GOTO(err, "only msg endpoints are supported");
+    }
+
+    ni->fi = get_fi(is_server, cfg);
     if (!ni->fi)
     {
         rc = -1;
@@ -91,18 +143,58 @@ int init_network(struct net_info *ni, bool is_server)
 
     print_short_info(ni->fi);
 
+    // the immediate data has to be able to hold a crc, see CMD_FLAG_CRC
+    ni->remote_cq_data = cfg->imm_data && ni->fi->domain_attr->cq_data_size >= sizeof(uint32_t);
+    printf("remote cq data: %s\n", ni->remote_cq_data ? "yes" : "no");
+
+    // servers never receive immediate data, they only send it
+    ni->cq_format = !is_server && ni->remote_cq_data ? FI_CQ_FORMAT_DATA : FI_CQ_FORMAT_CONTEXT;
+
+    // room for every posted receive and every transmit the provider takes before EAGAIN, so
+    // a full pipeline can't overflow the cq
+    tx_depth = ni->fi->tx_attr->size ? ni->fi->tx_attr->size : POST_QUEUE_DEPTH;
+    ni->cq_size = cfg->cq_size ? cfg->cq_size : cfg->rx_depth + tx_depth;
+
+    // a connection request, established and shutdown event per connection
+    eq_attr.size = cfg->eq_size ? cfg->eq_size : 3 * MAX_CONNECTIONS;
+
+    printf("cq: %zu entries, %s format, eq: %zu entries\n", ni->cq_size,
+           ni->cq_format == FI_CQ_FORMAT_DATA ? "data" : "context", eq_attr.size);
+
+    ni->atomics = (ni->fi->caps & FI_ATOMIC) != 0;
+    printf("native atomics: %s\n", ni->atomics ? "yes" : "no");
+
+    ni->inject_size = ni->fi->tx_attr->inject_size;
+    printf("inject size: %zu, command header %zu\n", ni->inject_size,
+           offsetof(struct network_cmd, batch));
+
     rc = fi_fabric(ni->fi->fabric_attr, &ni->fabric, NULL);
     if (rc < 0)
     {
         FI_GOTO(err1, "fi_fabric");
     }
 
+    // an fd backed wait set lets the server run from an external epoll loop, see server_wait_fd
+    wait_attr.wait_obj = FI_WAIT_FD;
     rc = fi_wait_open(ni->fabric, &wait_attr, &ni->wait_set);
     if (rc < 0)
+    {
+        wait_attr.wait_obj = FI_WAIT_UNSPEC;
+        rc = fi_wait_open(ni->fabric, &wait_attr, &ni->wait_set);
+    }
+    if (rc < 0)
     {
         FI_GOTO(err2, "fi_wait_open");
     }
 
+    ni->wait_fd = -1;
+    if (wait_attr.wait_obj == FI_WAIT_FD &&
+        fi_control(&ni->wait_set->fid, FI_GETWAIT, &ni->wait_fd) < 0)
+    {
+        ni->wait_fd = -1;
+    }
+    printf("wait fd: %d\n", ni->wait_fd);
+
     eq_attr.wait_set = ni->wait_set;
 
     printf("opening eq\n");
@@ -121,6 +213,24 @@ int init_network(struct net_info *ni, bool is_server)
     init_memory(ni);
 
     ni->connection_list = NULL;
+    ni->defer_posts = true;
+    ni->rx_depth = cfg->rx_depth;
+    ni->local_keys.rx_depth = ni->rx_depth;
+    // servers agree to features per connection, see add_connection
+    ni->local_keys.features = 0;
+    ni->local_keys.lease_ms = 0;
+    ni->local_keys.qos_weight = is_server ? 0 : cfg->qos_weight;
+
+    if (cfg->profile)
+    {
+        prof_enable();
+    }
+    if (!is_server)
+    {
+        ni->local_keys.features = FEATURE_DIRECT_STORE | FEATURE_RECLAIM |
+                                  (cfg->compress_min ? FEATURE_LZ : 0) |
+                                  (cfg->read_cache_size ? FEATURE_LEASE : 0);
+    }
 
     return 0;
 
@@ -136,6 +246,7 @@ err:
 
 void close_network(struct net_info *ni)
 {
+    delayed_forget(ni, NULL);
     close_memory(ni);
 
     fi_close((fid_t)ni->domain);
@@ -151,24 +262,49 @@ int get_client_id()
     return next_client_id++;
 }
 
-int setup_connection(struct net_info *ni, struct connection **cxn_ptr, struct fi_info *info)
+int open_cq(struct net_info *ni, size_t size, struct fid_cq **cq)
 {
     struct fi_cq_attr cq_attr = {
-        .format = FI_CQ_FORMAT_DATA, .wait_obj = FI_WAIT_SET, .wait_set = ni->wait_set};
-    struct connection *cxn = calloc(1, sizeof(struct connection));
+        .size = size,
+        .format = ni->cq_format,
+        .wait_obj = FI_WAIT_SET,
+        .wait_set = ni->wait_set};
+
+    return fi_cq_open(ni->domain, &cq_attr, cq, NULL);
+}
+
+int setup_connection(struct net_info *ni, struct connection **cxn_ptr, struct fi_info *info)
+{
+    // aligned so the hot fields at the start share one cache line
+    struct connection *cxn = aligned_alloc(CACHE_LINE, sizeof(struct connection));
     int rc = 0;
 
+    if (!cxn)
+    {
+        return -FI_ENOMEM;
+    }
+    memset(cxn, 0, sizeof(*cxn));
+
     if (cxn_ptr != NULL)
     {
         *cxn_ptr = cxn;
     }
 
     cxn->client_id = get_client_id();
+    cxn->ni = ni;
 
     printf("add_connection %d\n", cxn->client_id);
 
-    cxn->bulk_buf = alloc_bulk_buf();
+    // the server moves data straight between the store and the client, only clients stage it
+    cxn->bulk_buf = ni->is_server ? NULL : alloc_bulk_buf();
     cxn->cmd_buf = alloc_cmd_buf();
+    cxn->last_active = time(NULL);
+
+    if ((!ni->is_server && !cxn->bulk_buf) || !cxn->cmd_buf)
+    {
+        rc = -FI_ENOMEM;
+        GOTO(err, "out of buffers for connection %d", cxn->client_id);
+    }
 
     rc = fi_endpoint(ni->domain, info, &cxn->ep, NULL);
     if (rc)
@@ -183,10 +319,17 @@ int setup_connection(struct net_info *ni, struct connection **cxn_ptr, struct fi
     }
 
     // segfaults without cqs set up
-    rc = fi_cq_open(ni->domain, &cq_attr, &cxn->cq, NULL);
-    if (rc)
+    if (ni->cq)
+    {
+        cxn->cq = ni->cq;
+    }
+    else
     {
-        FI_GOTO(err1, "fi_cq_open");
+        rc = open_cq(ni, ni->cq_size, &cxn->cq);
+        if (rc)
+        {
+            FI_GOTO(err1, "fi_cq_open");
+        }
     }
 
     // if these flags are wrong, this will silently fail
@@ -203,6 +346,13 @@ int setup_connection(struct net_info *ni, struct connection **cxn_ptr, struct fi
         FI_GOTO(err2, "fi_enable");
     }
 
+    // receives go up before connecting so the peer's first message always has somewhere to land
+    rc = cmd_rx_init(cxn, ni->rx_depth);
+    if (rc)
+    {
+        FI_GOTO(err2, "cmd_rx_init");
+    }
+
     // XXX lock?
     cxn->next = ni->connection_list;
     ni->connection_list = cxn;
@@ -210,7 +360,10 @@ int setup_connection(struct net_info *ni, struct connection **cxn_ptr, struct fi
     return 0;
 
 err2:
-    fi_close((fid_t)cxn->cq);
+    if (cxn->cq != ni->cq)
+    {
+        fi_close((fid_t)cxn->cq);
+    }
 err1:
     fi_close((fid_t)cxn->ep);
 
@@ -221,4 +374,20 @@ err:
     free(cxn);
 
     return rc;
-}
\ No newline at end of file
+}
+
+void close_connection(struct connection *cxn)
+{
+    // tcp provider doesn't like having the cq closed before the ep
+    fi_close((fid_t)cxn->ep);
+    if (cxn->cq != cxn->ni->cq)
+    {
+        fi_close((fid_t)cxn->cq);
+    }
+
+    cmd_rx_close(cxn);
+    delayed_forget(cxn->ni, cxn);
+
+    free_bulk_buf(cxn->bulk_buf);
+    free_cmd_buf(cxn->cmd_buf);
+}
@@ -0,0 +1,160 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "obj_pool.h"
+
+// sits after the object, so the object itself starts on the cache line
+struct obj_header
+{
+    struct obj_cache *owner;
+    struct obj_header *next;
+};
+
+struct obj_cache
+{
+    struct obj_pool *pool;
+    // owner thread only
+    struct obj_header *local;
+    // pushed to by other threads, the owner takes the whole stack at once so there's no ABA
+    struct obj_header *returned;
+    struct obj_cache *next;
+};
+
+static size_t header_offset(struct obj_pool *pool)
+{
+    return (pool->size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+}
+
+static struct obj_header *header_of(struct obj_pool *pool, void *obj)
+{
+    return (struct obj_header *)((char *)obj + header_offset(pool));
+}
+
+static void *object_of(struct obj_pool *pool, struct obj_header *header)
+{
+    return (char *)header - header_offset(pool);
+}
+
+// thread exit, objects still out come back to the cache's returned stack
+static void orphan_cache(void *arg)
+{
+    struct obj_cache *cache = arg;
+    struct obj_pool *pool = cache->pool;
+
+    pthread_mutex_lock(&pool->lock);
+    cache->next = pool->orphans;
+    pool->orphans = cache;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static struct obj_cache *get_cache(struct obj_pool *pool)
+{
+    struct obj_cache *cache;
+
+    if (!__atomic_load_n(&pool->key_ready, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_lock(&pool->lock);
+        if (!pool->key_ready && pthread_key_create(&pool->key, orphan_cache) == 0)
+        {
+            __atomic_store_n(&pool->key_ready, true, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&pool->lock);
+
+        if (!pool->key_ready)
+        {
+            return NULL;
+        }
+    }
+
+    cache = pthread_getspecific(pool->key);
+    if (cache)
+    {
+        return cache;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    cache = pool->orphans;
+    if (cache)
+    {
+        pool->orphans = cache->next;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!cache)
+    {
+        cache = calloc(1, sizeof(*cache));
+        if (!cache)
+        {
+            return NULL;
+        }
+        cache->pool = pool;
+    }
+
+    pthread_setspecific(pool->key, cache);
+
+    return cache;
+}
+
+void *obj_alloc(struct obj_pool *pool)
+{
+    struct obj_cache *cache = get_cache(pool);
+    struct obj_header *header;
+    void *obj;
+
+    if (!cache)
+    {
+        return NULL;
+    }
+
+    if (!cache->local)
+    {
+        cache->local = __atomic_exchange_n(&cache->returned, NULL, __ATOMIC_ACQUIRE);
+    }
+
+    header = cache->local;
+    if (header)
+    {
+        cache->local = header->next;
+        return object_of(pool, header);
+    }
+
+    // aligned_alloc wants a multiple of the alignment
+    obj = aligned_alloc(CACHE_LINE, (header_offset(pool) + sizeof(*header) + CACHE_LINE - 1) &
+                                        ~(size_t)(CACHE_LINE - 1));
+    if (!obj)
+    {
+        return NULL;
+    }
+
+    header_of(pool, obj)->owner = cache;
+
+    return obj;
+}
+
+void obj_free(struct obj_pool *pool, void *obj)
+{
+    struct obj_header *header;
+    struct obj_cache *cache;
+
+    if (!obj)
+    {
+        return;
+    }
+
+    header = header_of(pool, obj);
+    cache = header->owner;
+
+    // the key exists, obj came from obj_alloc
+    if (pthread_getspecific(pool->key) == cache)
+    {
+        header->next = cache->local;
+        cache->local = header;
+        return;
+    }
+
+    header->next = __atomic_load_n(&cache->returned, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&cache->returned, &header->next, header, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    {
+    }
+}
@@ -0,0 +1,677 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <rdma/fi_errno.h>
+
+#include "log.h"
+#include "persist.h"
+
+// user_data of a page-in read, writes carry their first page and page count
+#define READ_TAG UINT64_MAX
+
+// the parts of the io_uring interface used here, without depending on liburing
+struct uring
+{
+    int fd;
+    unsigned entries;
+
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    // queued sqes are published with the next uring_submit
+    unsigned sq_local_tail;
+    unsigned sq_submitted;
+
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+};
+
+static int persist_fd = -1;
+static char *persist_store;
+static size_t persist_pages;
+// bit per page
+static uint64_t *resident;
+static uint64_t *dirty;
+// a write of the page is in flight, it isn't written again until that one finishes so the
+// writes can't land out of order
+static uint64_t *writing;
+static size_t dirty_count;
+static uint64_t first_dirty_ms;
+static int inflight;
+
+static bool use_ring;
+static struct uring ring;
+// the result of a page-in read, set when it completes
+static bool read_done;
+static int read_res;
+
+static uint64_t pages_written;
+static uint64_t writes;
+static uint64_t pages_read;
+static uint64_t write_failures;
+
+static bool test_bit(uint64_t *map, size_t page)
+{
+    return map[page / 64] & (1ULL << (page % 64));
+}
+
+static void set_bit(uint64_t *map, size_t page)
+{
+    map[page / 64] |= 1ULL << (page % 64);
+}
+
+static void clear_bit(uint64_t *map, size_t page)
+{
+    map[page / 64] &= ~(1ULL << (page % 64));
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int uring_enter(unsigned to_submit, unsigned min_complete)
+{
+    int rc = syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete,
+                     min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+
+    return rc < 0 ? -errno : rc;
+}
+
+static int uring_init(unsigned entries)
+{
+    struct io_uring_params p;
+
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring.fd < 0)
+    {
+        return -errno;
+    }
+
+    ring.entries = p.sq_entries;
+    ring.sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring.sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    // newer kernels map both rings at once
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ring.cq_ring_size > ring.sq_ring_size)
+        {
+            ring.sq_ring_size = ring.cq_ring_size;
+        }
+        ring.cq_ring_size = ring.sq_ring_size;
+    }
+
+    ring.sq_ring = mmap(NULL, ring.sq_ring_size, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.cq_ring = ring.sq_ring;
+    if (ring.sq_ring != MAP_FAILED && !(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        ring.cq_ring = mmap(NULL, ring.cq_ring_size, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+    }
+    ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                     ring.fd, IORING_OFF_SQES);
+
+    if (ring.sq_ring == MAP_FAILED || ring.cq_ring == MAP_FAILED || ring.sqes == MAP_FAILED)
+    {
+        // the fd holds the mappings that did work, closing it is enough to drop them
+        close(ring.fd);
+        return -FI_ENOMEM;
+    }
+
+    ring.sq_head = (unsigned *)((char *)ring.sq_ring + p.sq_off.head);
+    ring.sq_tail = (unsigned *)((char *)ring.sq_ring + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)((char *)ring.sq_ring + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)((char *)ring.sq_ring + p.sq_off.array);
+    ring.cq_head = (unsigned *)((char *)ring.cq_ring + p.cq_off.head);
+    ring.cq_tail = (unsigned *)((char *)ring.cq_ring + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)((char *)ring.cq_ring + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ring + p.cq_off.cqes);
+    ring.sq_local_tail = *ring.sq_tail;
+    ring.sq_submitted = ring.sq_local_tail;
+
+    return 0;
+}
+
+static void uring_close(void)
+{
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ring != ring.sq_ring)
+    {
+        munmap(ring.cq_ring, ring.cq_ring_size);
+    }
+    munmap(ring.sq_ring, ring.sq_ring_size);
+    close(ring.fd);
+}
+
+// NULL when the submission queue is full
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned idx;
+    struct io_uring_sqe *sqe;
+
+    if (ring.sq_local_tail - head >= ring.entries)
+    {
+        return NULL;
+    }
+
+    idx = ring.sq_local_tail & *ring.sq_mask;
+    ring.sq_array[idx] = idx;
+    ring.sq_local_tail++;
+
+    sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+
+    return sqe;
+}
+
+// every sqe queued since the last call goes to the kernel in one io_uring_enter
+static int uring_submit(unsigned min_complete)
+{
+    unsigned count = ring.sq_local_tail - ring.sq_submitted;
+    int rc;
+
+    if (count == 0 && min_complete == 0)
+    {
+        return 0;
+    }
+
+    __atomic_store_n(ring.sq_tail, ring.sq_local_tail, __ATOMIC_RELEASE);
+    do
+    {
+        rc = uring_enter(count, min_complete);
+    } while (rc == -EINTR);
+
+    if (rc >= 0)
+    {
+        ring.sq_submitted = ring.sq_local_tail;
+    }
+
+    return rc;
+}
+
+static void prep_rw(struct io_uring_sqe *sqe, int op, size_t page, size_t count,
+                    uint64_t user_data)
+{
+    sqe->opcode = op;
+    sqe->fd = persist_fd;
+    sqe->addr = (uintptr_t)(persist_store + page * PERSIST_PAGE);
+    sqe->len = count * PERSIST_PAGE;
+    sqe->off = page * PERSIST_PAGE;
+    sqe->user_data = user_data;
+}
+
+// a failed or short write leaves its pages dirty to be tried again
+static void write_done(size_t page, size_t count, ssize_t res)
+{
+    inflight--;
+
+    for (size_t i = page; i < page + count; i++)
+    {
+        clear_bit(writing, i);
+    }
+
+    if (res == (ssize_t)(count * PERSIST_PAGE))
+    {
+        pages_written += count;
+        writes++;
+        return;
+    }
+
+    fprintf(stderr, "persist: write of %zu pages at page %zu failed: %s\n", count, page,
+            res < 0 ? strerror(-res) : "short write");
+    write_failures++;
+    for (size_t i = page; i < page + count; i++)
+    {
+        if (!test_bit(dirty, i))
+        {
+            set_bit(dirty, i);
+            dirty_count++;
+        }
+    }
+}
+
+static void reap(void)
+{
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++)
+    {
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+        if (cqe->user_data == READ_TAG)
+        {
+            read_res = cqe->res;
+            read_done = true;
+        }
+        else
+        {
+            write_done(cqe->user_data & UINT32_MAX, cqe->user_data >> 32, cqe->res);
+        }
+    }
+
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+static void write_pages(size_t page, size_t count)
+{
+    struct io_uring_sqe *sqe;
+
+    for (size_t i = page; i < page + count; i++)
+    {
+        clear_bit(dirty, i);
+        set_bit(writing, i);
+    }
+    dirty_count -= count;
+    inflight++;
+
+    if (!use_ring)
+    {
+        ssize_t res = pwrite(persist_fd, persist_store + page * PERSIST_PAGE,
+                             count * PERSIST_PAGE, page * PERSIST_PAGE);
+
+        write_done(page, count, res < 0 ? -errno : res);
+        return;
+    }
+
+    // the queue holds PERSIST_QUEUE_DEPTH entries and no more are ever in flight
+    sqe = uring_get_sqe();
+    prep_rw(sqe, IORING_OP_WRITE, page, count, (uint64_t)count << 32 | page);
+}
+
+// queues a write for every run of dirty pages without one in flight, then submits them together
+static void flush(void)
+{
+    size_t page = 0;
+
+    while (page < persist_pages && dirty_count && inflight < PERSIST_QUEUE_DEPTH)
+    {
+        size_t count = 0;
+
+        // whole words without a dirty page are skipped at once
+        if (!dirty[page / 64])
+        {
+            page = (page / 64 + 1) * 64;
+            continue;
+        }
+
+        while (page + count < persist_pages && count < PERSIST_MAX_RUN &&
+               test_bit(dirty, page + count) && !test_bit(writing, page + count))
+        {
+            count++;
+        }
+
+        if (count)
+        {
+            write_pages(page, count);
+            page += count;
+        }
+        else
+        {
+            page++;
+        }
+    }
+
+    if (use_ring)
+    {
+        int rc = uring_submit(0);
+
+        if (rc < 0)
+        {
+            fprintf(stderr, "persist: io_uring_enter: %s\n", strerror(-rc));
+        }
+    }
+}
+
+static int read_pages(size_t page, size_t count)
+{
+    struct io_uring_sqe *sqe;
+    ssize_t res;
+
+    if (!use_ring)
+    {
+        res = pread(persist_fd, persist_store + page * PERSIST_PAGE, count * PERSIST_PAGE,
+                    page * PERSIST_PAGE);
+        res = res < 0 ? -errno : res;
+    }
+    else
+    {
+        // a full queue only holds writes, which finish on their own
+        while (!(sqe = uring_get_sqe()))
+        {
+            uring_submit(1);
+            reap();
+        }
+        prep_rw(sqe, IORING_OP_READ, page, count, READ_TAG);
+
+        read_done = false;
+        read_res = 0;
+        do
+        {
+            res = uring_submit(1);
+            if (res >= 0)
+            {
+                reap();
+            }
+        } while (res >= 0 && !read_done);
+
+        if (res >= 0)
+        {
+            res = read_res;
+        }
+    }
+
+    if (res < 0)
+    {
+        fprintf(stderr, "persist: read of %zu pages at page %zu failed: %s\n", count, page,
+                strerror(-res));
+        return -FI_EIO;
+    }
+
+    // the file was sized to the store when opened, but someone may have truncated it since
+    if ((size_t)res < count * PERSIST_PAGE)
+    {
+        memset(persist_store + page * PERSIST_PAGE + res, 0, count * PERSIST_PAGE - res);
+    }
+
+    pages_read += count;
+
+    return 0;
+}
+
+int persist_open(const char *path, void *store, size_t size)
+{
+    size_t words = (size / PERSIST_PAGE + 63) / 64;
+    size_t file_pages;
+    struct stat st;
+    int rc;
+
+    if ((uintptr_t)store % PERSIST_PAGE || size % PERSIST_PAGE)
+    {
+        rc = -FI_EINVAL;
+        GOTO(err, "persist: store isn't page aligned");
+    }
+
+    persist_fd = open(path, O_RDWR | O_CREAT | O_DIRECT, 0600);
+    if (persist_fd < 0 && errno == EINVAL)
+    {
+        // tmpfs and some others have no O_DIRECT, the page cache is still better than nothing
+        fprintf(stderr, "persist: no O_DIRECT for %s, writing through the page cache\n", path);
+        persist_fd = open(path, O_RDWR | O_CREAT, 0600);
+    }
+    if (persist_fd < 0)
+    {
+        rc = -errno;
+        GOTO(err, "persist: unable to open %s: %s", path, strerror(errno));
+    }
+
+    if (fstat(persist_fd, &st) < 0 || (st.st_size < size && ftruncate(persist_fd, size) < 0))
+    {
+        rc = -errno;
+        GOTO(err1, "persist: unable to size %s: %s", path, strerror(errno));
+    }
+
+    persist_store = store;
+    persist_pages = size / PERSIST_PAGE;
+    resident = calloc(words, sizeof(uint64_t));
+    dirty = calloc(words, sizeof(uint64_t));
+    writing = calloc(words, sizeof(uint64_t));
+    if (!resident || !dirty || !writing)
+    {
+        rc = -FI_ENOMEM;
+        GOTO(err2, "persist: out of memory");
+    }
+
+    // pages past the old end of the file are zero, like the store
+    file_pages = (st.st_size + PERSIST_PAGE - 1) / PERSIST_PAGE;
+    for (size_t page = file_pages; page < persist_pages; page++)
+    {
+        set_bit(resident, page);
+    }
+
+    rc = uring_init(PERSIST_QUEUE_DEPTH);
+    use_ring = rc == 0;
+    if (!use_ring)
+    {
+        fprintf(stderr, "persist: no io_uring (%s), writing synchronously\n", strerror(-rc));
+    }
+
+    dirty_count = 0;
+    inflight = 0;
+    pages_written = writes = pages_read = write_failures = 0;
+
+    printf("persisting store to %s, %zu of %zu pages on file\n", path,
+           file_pages < persist_pages ? file_pages : persist_pages, persist_pages);
+
+    return 0;
+
+err2:
+    free(resident);
+    free(dirty);
+    free(writing);
+err1:
+    close(persist_fd);
+    persist_fd = -1;
+err:
+    return rc;
+}
+
+// pages whose writes kept failing when the store closed, by run
+static void report_lost(void)
+{
+    size_t page = 0;
+
+    fprintf(stderr, "persist: giving up, %zu pages never reached the file\n", dirty_count);
+    while (page < persist_pages)
+    {
+        size_t count = 0;
+
+        while (page + count < persist_pages && test_bit(dirty, page + count))
+        {
+            count++;
+        }
+
+        if (count)
+        {
+            fprintf(stderr, "persist: lost pages %zu to %zu\n", page, page + count - 1);
+            page += count;
+        }
+        else
+        {
+            page++;
+        }
+    }
+}
+
+void persist_close(void)
+{
+    int failed_passes = 0;
+
+    if (persist_fd < 0)
+    {
+        return;
+    }
+
+    // a failed write leaves its pages dirty, an error that persists like ENOSPC or EIO would
+    // keep them that way forever
+    while ((dirty_count || inflight) && failed_passes < PERSIST_CLOSE_PASSES)
+    {
+        uint64_t failures = write_failures;
+        uint64_t written = pages_written;
+
+        flush();
+        if (use_ring && inflight)
+        {
+            uring_submit(1);
+            reap();
+        }
+
+        if (pages_written != written)
+        {
+            failed_passes = 0;
+        }
+        else if (write_failures != failures)
+        {
+            failed_passes++;
+        }
+    }
+
+    // the store's memory has to outlive whatever the ring still has in flight
+    while (use_ring && inflight)
+    {
+        uring_submit(1);
+        reap();
+    }
+
+    if (dirty_count)
+    {
+        report_lost();
+    }
+
+    fdatasync(persist_fd);
+    printf("persist: %llu pages written in %llu writes, %llu pages read\n",
+           (unsigned long long)pages_written, (unsigned long long)writes,
+           (unsigned long long)pages_read);
+
+    if (use_ring)
+    {
+        uring_close();
+    }
+    close(persist_fd);
+    persist_fd = -1;
+
+    free(resident);
+    free(dirty);
+    free(writing);
+    resident = dirty = writing = NULL;
+}
+
+bool persist_enabled(void)
+{
+    return persist_fd >= 0;
+}
+
+int persist_fault_in(uint64_t offset, size_t len)
+{
+    size_t last;
+
+    if (persist_fd < 0 || len == 0)
+    {
+        return 0;
+    }
+
+    last = (offset + len - 1) / PERSIST_PAGE;
+    for (size_t page = offset / PERSIST_PAGE; page <= last; page++)
+    {
+        size_t count = 0;
+        int rc;
+
+        while (page + count <= last && count < PERSIST_MAX_RUN &&
+               !test_bit(resident, page + count))
+        {
+            count++;
+        }
+
+        if (count == 0)
+        {
+            continue;
+        }
+
+        rc = read_pages(page, count);
+        if (rc < 0)
+        {
+            return rc;
+        }
+
+        for (size_t i = page; i < page + count; i++)
+        {
+            set_bit(resident, i);
+        }
+        page += count - 1;
+    }
+
+    return 0;
+}
+
+void persist_dirty(uint64_t offset, size_t len)
+{
+    size_t last;
+
+    if (persist_fd < 0 || len == 0)
+    {
+        return;
+    }
+
+    if (dirty_count == 0)
+    {
+        first_dirty_ms = now_ms();
+    }
+
+    last = (offset + len - 1) / PERSIST_PAGE;
+    for (size_t page = offset / PERSIST_PAGE; page <= last; page++)
+    {
+        if (!test_bit(dirty, page))
+        {
+            set_bit(dirty, page);
+            dirty_count++;
+        }
+    }
+}
+
+void persist_progress(void)
+{
+    if (persist_fd < 0)
+    {
+        return;
+    }
+
+    if (use_ring && inflight)
+    {
+        reap();
+    }
+
+    if (dirty_count &&
+        (dirty_count >= PERSIST_HIGH_WATER || now_ms() - first_dirty_ms >= PERSIST_FLUSH_MS))
+    {
+        flush();
+
+        // what's left waits for writes in flight to the same pages, or for room in the queue
+        first_dirty_ms = now_ms();
+    }
+}
+
+bool persist_busy(void)
+{
+    return persist_fd >= 0 && (dirty_count || inflight);
+}
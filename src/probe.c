@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <rdma/fabric.h>
+#include <rdma/fi_errno.h>
+
+#include "client_pool.h"
+#include "config.h"
+#include "log.h"
+#include "mem.h"
+#include "network.h"
+
+// providers the probe tries, in order
+static const char *probe_providers[] = {"tcp", "sockets", "shm", "udp"};
+
+#define PROBE_OPS 2000
+
+// blocking write/read pairs of len bytes over one connection, returns ops/s or < 0
+static double probe_provider(const struct net_config *cfg, size_t len)
+{
+    struct client_pool_attr attr = {
+        .cxns_per_server = 1,
+        .layout = LAYOUT_CONTIGUOUS,
+        .net = cfg,
+        // the server shares its store with us, without this every provider times the same memcpy
+        .no_local_path = true,
+    };
+    struct client_pool *pool;
+    struct timespec start, end;
+    char *buf = calloc(1, len);
+    double rate = -1;
+    pid_t pid;
+    int rc = 0;
+
+    pid = fork_server(cfg);
+    if (pid < 0)
+    {
+        free(buf);
+        return -1;
+    }
+
+    pool = connect_forked_server(cfg, &attr);
+    if (pool)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i = 0; i < PROBE_OPS && rc == 0; i++)
+        {
+            rc = i % 2 ? client_read(pool, 0, buf, len) : client_write(pool, 0, buf, len);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        if (rc == 0)
+        {
+            rate = PROBE_OPS /
+                   ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+        }
+
+        client_pool_close(pool);
+    }
+
+    stop_forked_server(pid);
+    free(buf);
+
+    return rate;
+}
+
+/*
+Runs a loopback server and a client for each provider with getinfo results and times len byte
+transfers over it. The fastest provider goes into out_path as a config file both sides can load,
+if out_path is set.
+*/
+int run_probe(const struct net_config *base, size_t len, const char *out_path)
+{
+    struct net_config best;
+    double best_rate = 0;
+    int rc = 0;
+
+    for (int i = 0; i < sizeof(probe_providers) / sizeof(*probe_providers); i++)
+    {
+        struct net_config cfg = *base;
+        struct fi_info *fi;
+        double rate;
+
+        snprintf(cfg.provider, sizeof(cfg.provider), "%s", probe_providers[i]);
+        // see fork_server
+        cfg.port = base->port + 1 + i;
+
+        fi = get_fi(true, &cfg);
+        if (!fi)
+        {
+            printf("probe: %s unavailable\n", cfg.provider);
+            continue;
+        }
+        free_fi(fi);
+
+        rate = probe_provider(&cfg, len);
+        if (rate < 0)
+        {
+            printf("probe: %s failed\n", cfg.provider);
+            continue;
+        }
+
+        printf("probe: %s %.0f ops/s, %.1f MB/s\n", cfg.provider, rate, rate * len / 1e6);
+        if (rate > best_rate)
+        {
+            best_rate = rate;
+            best = cfg;
+            best.port = base->port;
+        }
+    }
+
+    if (best_rate == 0)
+    {
+        rc = -FI_ENODATA;
+        GOTO(err, "no provider worked");
+    }
+
+    printf("probe: fastest provider for %zu byte ops is %s\n", len, best.provider);
+
+    if (out_path)
+    {
+        FILE *f = fopen(out_path, "w");
+
+        if (!f)
+        {
+            rc = -FI_EIO;
+            GOTO(err, "unable to write %s", out_path);
+        }
+
+        config_print(&best, f);
+        fclose(f);
+        printf("probe: wrote %s\n", out_path);
+    }
+
+    return 0;
+
+err:
+    return rc;
+}
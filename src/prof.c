@@ -0,0 +1,273 @@
+// for dladdr
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <rdma/fabric.h>
+
+#include "prof.h"
+
+// distinct callbacks per thread, the rest share one row
+#define PROF_CALLBACKS 64
+// FI_NOTIFY up to FI_JOIN_COMPLETE, anything past it shares one row
+#define PROF_EQ_EVENTS 16
+
+struct prof_entry
+{
+    uint64_t calls;
+    // including the dispatches nested inside
+    uint64_t cycles;
+    uint64_t self;
+    uint64_t max;
+};
+
+// written only by its thread, so a dump while it runs is approximate. Kept after the thread exits
+struct prof_table
+{
+    struct prof_table *next;
+    int id;
+    // cycles of the dispatches nested inside the one running now
+    uint64_t child;
+    void *callbacks[PROF_CALLBACKS];
+    struct prof_entry callback_entries[PROF_CALLBACKS + 1];
+    struct prof_entry eq_entries[PROF_EQ_EVENTS + 1];
+};
+
+bool prof_enabled = false;
+
+static pthread_mutex_t tables_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct prof_table *tables = NULL;
+static int table_count = 0;
+static __thread struct prof_table *thread_table = NULL;
+
+static volatile sig_atomic_t dump_requested = 0;
+
+// where the cycle counter was when profiling started, to convert cycles to time
+static uint64_t enable_cycles;
+static struct timespec enable_time;
+
+void prof_enable(void)
+{
+    if (prof_enabled)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &enable_time);
+    enable_cycles = prof_now();
+    prof_enabled = true;
+}
+
+static struct prof_table *get_table(void)
+{
+    if (!thread_table)
+    {
+        thread_table = calloc(1, sizeof(*thread_table));
+        if (!thread_table)
+        {
+            return NULL;
+        }
+
+        pthread_mutex_lock(&tables_lock);
+        thread_table->id = table_count++;
+        thread_table->next = tables;
+        tables = thread_table;
+        pthread_mutex_unlock(&tables_lock);
+    }
+
+    return thread_table;
+}
+
+void prof_begin(struct prof_frame *frame)
+{
+    struct prof_table *t = get_table();
+
+    frame->start = prof_now();
+    frame->saved_child = t ? t->child : 0;
+    if (t)
+    {
+        t->child = 0;
+    }
+}
+
+static void charge(struct prof_table *t, struct prof_entry *e, struct prof_frame *frame)
+{
+    uint64_t cycles = prof_now() - frame->start;
+
+    e->calls++;
+    e->cycles += cycles;
+    e->self += cycles - t->child;
+    if (cycles > e->max)
+    {
+        e->max = cycles;
+    }
+
+    t->child = frame->saved_child + cycles;
+}
+
+void prof_end_callback(struct prof_frame *frame, void *callback)
+{
+    struct prof_table *t = thread_table;
+    unsigned slot = ((uintptr_t)callback >> 4) % PROF_CALLBACKS;
+    int i;
+
+    if (!t)
+    {
+        return;
+    }
+
+    for (i = 0; i < PROF_CALLBACKS; i++, slot = (slot + 1) % PROF_CALLBACKS)
+    {
+        if (t->callbacks[slot] == callback || !t->callbacks[slot])
+        {
+            t->callbacks[slot] = callback;
+            break;
+        }
+    }
+
+    charge(t, &t->callback_entries[i < PROF_CALLBACKS ? slot : PROF_CALLBACKS], frame);
+}
+
+void prof_end_eq(struct prof_frame *frame, uint32_t event)
+{
+    struct prof_table *t = thread_table;
+
+    if (!t)
+    {
+        return;
+    }
+
+    charge(t, &t->eq_entries[event < PROF_EQ_EVENTS ? event : PROF_EQ_EVENTS], frame);
+}
+
+static const struct prof_entry *sort_entries;
+
+static int by_self(const void *a, const void *b)
+{
+    uint64_t sa = sort_entries[*(const int *)a].self;
+    uint64_t sb = sort_entries[*(const int *)b].self;
+
+    return sa < sb ? 1 : sa > sb ? -1 : 0;
+}
+
+static void callback_name(void *callback, char *name, size_t len)
+{
+    Dl_info info;
+
+    if (!callback)
+    {
+        snprintf(name, len, "(other)");
+    }
+    else if (!dladdr(callback, &info))
+    {
+        snprintf(name, len, "%p", callback);
+    }
+    else if (info.dli_sname)
+    {
+        snprintf(name, len, "%s+%#lx", info.dli_sname,
+                 (unsigned long)((char *)callback - (char *)info.dli_saddr));
+    }
+    else
+    {
+        const char *module = strrchr(info.dli_fname, '/');
+
+        snprintf(name, len, "%s+%#lx", module ? module + 1 : info.dli_fname,
+                 (unsigned long)((char *)callback - (char *)info.dli_fbase));
+    }
+}
+
+static void dump_row(FILE *f, const char *name, const struct prof_entry *e, double ns_per_cycle)
+{
+    fprintf(f, "  %-40s %10llu %14llu %14llu %10.0f %10.0f\n", name,
+            (unsigned long long)e->calls, (unsigned long long)e->cycles,
+            (unsigned long long)e->self, (double)e->self / e->calls * ns_per_cycle,
+            e->max * ns_per_cycle);
+}
+
+static void dump_table(FILE *f, struct prof_table *t, double ns_per_cycle)
+{
+    int order[PROF_CALLBACKS + 1];
+    int count = 0;
+    char name[128];
+
+    fprintf(f, "thread %d:\n", t->id);
+    fprintf(f, "  %-40s %10s %14s %14s %10s %10s\n", "callback or event", "calls", "cycles",
+            "self", "self ns", "max ns");
+
+    for (int i = 0; i <= PROF_CALLBACKS; i++)
+    {
+        if (t->callback_entries[i].calls)
+        {
+            order[count++] = i;
+        }
+    }
+    sort_entries = t->callback_entries;
+    qsort(order, count, sizeof(*order), by_self);
+
+    for (int i = 0; i < count; i++)
+    {
+        callback_name(order[i] < PROF_CALLBACKS ? t->callbacks[order[i]] : NULL, name,
+                      sizeof(name));
+        dump_row(f, name, &t->callback_entries[order[i]], ns_per_cycle);
+    }
+
+    for (uint32_t event = 0; event <= PROF_EQ_EVENTS; event++)
+    {
+        if (!t->eq_entries[event].calls)
+        {
+            continue;
+        }
+
+        if (event < PROF_EQ_EVENTS)
+        {
+            snprintf(name, sizeof(name), "eq %s", fi_tostr(&event, FI_TYPE_EQ_EVENT));
+        }
+        else
+        {
+            snprintf(name, sizeof(name), "eq (other)");
+        }
+        dump_row(f, name, &t->eq_entries[event], ns_per_cycle);
+    }
+}
+
+void prof_dump(FILE *f)
+{
+    struct timespec now;
+    uint64_t cycles = prof_now() - enable_cycles;
+    double ns;
+
+    if (!prof_enabled)
+    {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    ns = (now.tv_sec - enable_time.tv_sec) * 1e9 + (now.tv_nsec - enable_time.tv_nsec);
+
+    fprintf(f, "profile: %.3f s, %.3f cycles per ns\n", ns / 1e9, cycles / (ns ? ns : 1));
+
+    pthread_mutex_lock(&tables_lock);
+    for (struct prof_table *t = tables; t; t = t->next)
+    {
+        dump_table(f, t, cycles ? ns / cycles : 0);
+    }
+    pthread_mutex_unlock(&tables_lock);
+}
+
+void prof_request_dump(void)
+{
+    dump_requested = 1;
+}
+
+void prof_poll(void)
+{
+    if (dump_requested)
+    {
+        dump_requested = 0;
+        prof_dump(stderr);
+    }
+}
@@ -0,0 +1,163 @@
+#include <assert.h>
+
+#include "network.h"
+#include "prof.h"
+#include "qos.h"
+
+// small commands in arrival order
+static struct connection *small_head = NULL;
+static struct connection *small_tail = NULL;
+// bulk commands by finish tag, lowest first
+static struct connection *bulk_head = NULL;
+// finish tag of the last bulk command started, new arrivals can't start behind it
+static uint64_t virtual_time = 0;
+static size_t bulk_inflight = 0;
+
+static bool is_small(struct network_request *rq, size_t bytes)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+
+    if (cmd->priority == PRIO_LATENCY)
+    {
+        return true;
+    }
+    else if (cmd->priority == PRIO_BULK)
+    {
+        return false;
+    }
+
+    return bytes <= rq->cxn->ni->cfg.qos_small_max;
+}
+
+void qos_submit(struct network_request *rq, size_t bytes)
+{
+    struct connection *cxn = rq->cxn;
+
+    // the scheduler starts the working command through cmd_rq
+    assert(rq == &cxn->cmd_rq);
+
+    cxn->qos_next = NULL;
+    cxn->qos_bytes = bytes;
+    cxn->qos_queued = true;
+    cxn->qos_bulk = !is_small(rq, bytes);
+
+    if (!cxn->qos_bulk)
+    {
+        if (small_tail)
+        {
+            small_tail->qos_next = cxn;
+        }
+        else
+        {
+            small_head = cxn;
+        }
+        small_tail = cxn;
+    }
+    else
+    {
+        uint64_t weight = cxn->remote_keys.qos_weight ? cxn->remote_keys.qos_weight : 1;
+        uint64_t start = cxn->qos_finish > virtual_time ? cxn->qos_finish : virtual_time;
+        struct connection **link = &bulk_head;
+
+        cxn->qos_finish = start + bytes / weight;
+        while (*link && (*link)->qos_finish <= cxn->qos_finish)
+        {
+            link = &(*link)->qos_next;
+        }
+        cxn->qos_next = *link;
+        *link = cxn;
+    }
+}
+
+static void start(struct connection *cxn)
+{
+    void (*callback)(struct network_request *) = cxn->cmd_rq.callback;
+    struct prof_frame frame;
+
+    cxn->qos_queued = false;
+    if (prof_enabled)
+    {
+        prof_begin(&frame);
+    }
+    callback(&cxn->cmd_rq);
+    if (prof_enabled)
+    {
+        prof_end_callback(&frame, (void *)callback);
+    }
+}
+
+bool qos_dispatch(struct net_info *ni)
+{
+    size_t cap = ni->cfg.qos_bulk_bytes;
+    bool started = false;
+
+    while (small_head)
+    {
+        struct connection *cxn = small_head;
+
+        small_head = cxn->qos_next;
+        if (!small_head)
+        {
+            small_tail = NULL;
+        }
+
+        start(cxn);
+        started = true;
+    }
+
+    while (bulk_head && (!cap || !bulk_inflight || bulk_inflight + bulk_head->qos_bytes <= cap))
+    {
+        struct connection *cxn = bulk_head;
+
+        bulk_head = cxn->qos_next;
+        virtual_time = cxn->qos_finish;
+        bulk_inflight += cxn->qos_bytes;
+        cxn->qos_inflight = true;
+
+        start(cxn);
+        started = true;
+    }
+
+    return started;
+}
+
+void qos_done(struct connection *cxn)
+{
+    if (cxn->qos_inflight)
+    {
+        bulk_inflight -= cxn->qos_bytes;
+        cxn->qos_inflight = false;
+    }
+}
+
+void qos_forget(struct connection *cxn)
+{
+    qos_done(cxn);
+
+    if (!cxn->qos_queued)
+    {
+        return;
+    }
+
+    for (struct connection **link = cxn->qos_bulk ? &bulk_head : &small_head; *link;
+         link = &(*link)->qos_next)
+    {
+        if (*link != cxn)
+        {
+            continue;
+        }
+
+        *link = cxn->qos_next;
+        if (small_tail == cxn)
+        {
+            small_tail = NULL;
+            for (struct connection *c = small_head; c; c = c->qos_next)
+            {
+                small_tail = c;
+            }
+        }
+        break;
+    }
+
+    cxn->qos_queued = false;
+}
@@ -0,0 +1,345 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <rdma/fi_domain.h>
+
+#include "mem.h"
+#include "read_cache.h"
+
+enum cache_state
+{
+    CACHE_FREE = 0,
+    CACHE_VALID,
+    // a fill or revalidation is in flight, the slot belongs to it
+    CACHE_FILLING
+};
+
+struct cache_entry
+{
+    uint64_t addr;
+    // CLOCK_MONOTONIC ns, taken from when the fill was sent so it never outlives the server's
+    uint64_t lease_end;
+    uint32_t version;
+    // next entry in the same hash bucket, -1 at the end
+    int next;
+    uint8_t state;
+    // CLOCK bit, set by every hit
+    bool referenced;
+    // written while filling, the fill is thrown away
+    bool dropped;
+};
+
+struct read_cache
+{
+    pthread_mutex_t lock;
+    char *slots;
+    struct cache_entry *entries;
+    int slot_count;
+    int *buckets;
+    uint32_t bucket_mask;
+    int hand;
+
+    unsigned long long hits;
+    unsigned long long fills;
+    unsigned long long revalidated;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t bucket_of(struct read_cache *cache, uint64_t addr)
+{
+    return ((addr / LEASE_BLOCK) * 0x9e3779b97f4a7c15ull >> 32) & cache->bucket_mask;
+}
+
+static struct cache_entry *find(struct read_cache *cache, uint64_t addr)
+{
+    for (int i = cache->buckets[bucket_of(cache, addr)]; i >= 0; i = cache->entries[i].next)
+    {
+        if (cache->entries[i].addr == addr && cache->entries[i].state != CACHE_FREE)
+        {
+            return &cache->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+static void link_entry(struct read_cache *cache, int slot)
+{
+    int *bucket = &cache->buckets[bucket_of(cache, cache->entries[slot].addr)];
+
+    cache->entries[slot].next = *bucket;
+    *bucket = slot;
+}
+
+static void unlink_entry(struct read_cache *cache, int slot)
+{
+    int *link = &cache->buckets[bucket_of(cache, cache->entries[slot].addr)];
+
+    while (*link >= 0 && *link != slot)
+    {
+        link = &cache->entries[*link].next;
+    }
+    if (*link == slot)
+    {
+        *link = cache->entries[slot].next;
+    }
+
+    cache->entries[slot].state = CACHE_FREE;
+}
+
+// the next slot past the hand that isn't filling and hasn't been hit since the hand last passed
+static int evict(struct read_cache *cache)
+{
+    for (int n = 0; n < 2 * cache->slot_count; n++)
+    {
+        int slot = cache->hand;
+        struct cache_entry *e = &cache->entries[slot];
+
+        cache->hand = (cache->hand + 1) % cache->slot_count;
+        if (e->state == CACHE_FILLING)
+        {
+            continue;
+        }
+        if (e->state == CACHE_VALID && e->referenced)
+        {
+            e->referenced = false;
+            continue;
+        }
+
+        if (e->state == CACHE_VALID)
+        {
+            unlink_entry(cache, slot);
+        }
+
+        return slot;
+    }
+
+    return -1;
+}
+
+struct read_cache *read_cache_open(struct net_info *ni, size_t size)
+{
+    struct read_cache *cache;
+    int slot_count = size / LEASE_BLOCK;
+    uint32_t bucket_count = 1;
+
+    if (slot_count < 1)
+    {
+        fprintf(stderr, "read cache needs at least %d bytes\n", LEASE_BLOCK);
+        return NULL;
+    }
+
+    while (bucket_count < slot_count)
+    {
+        bucket_count <<= 1;
+    }
+
+    cache = calloc(1, sizeof(*cache));
+    cache->entries = calloc(slot_count, sizeof(*cache->entries));
+    cache->buckets = malloc(bucket_count * sizeof(*cache->buckets));
+    cache->slots = alloc_cache_mem(ni, (size_t)slot_count * LEASE_BLOCK);
+    if (!cache->entries || !cache->buckets || !cache->slots)
+    {
+        fprintf(stderr, "unable to allocate a %zu byte read cache\n", size);
+        free_cache_mem(cache->slots);
+        free(cache->entries);
+        free(cache->buckets);
+        free(cache);
+        return NULL;
+    }
+
+    memset(cache->buckets, 0xff, bucket_count * sizeof(*cache->buckets));
+    cache->slot_count = slot_count;
+    cache->bucket_mask = bucket_count - 1;
+    pthread_mutex_init(&cache->lock, NULL);
+
+    return cache;
+}
+
+void read_cache_close(struct read_cache *cache)
+{
+    printf("read cache: %llu hits, %llu fills, %llu revalidated\n", cache->hits, cache->fills,
+           cache->revalidated);
+
+    pthread_mutex_destroy(&cache->lock);
+    free_cache_mem(cache->slots);
+    free(cache->entries);
+    free(cache->buckets);
+    free(cache);
+}
+
+bool read_cache_read(struct read_cache *cache, uint64_t addr, void *buf, size_t len)
+{
+    uint64_t first = addr - addr % LEASE_BLOCK;
+    uint64_t now = now_ns();
+    char *dst = buf;
+
+    if (!len)
+    {
+        return false;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    for (uint64_t block = first; block < addr + len; block += LEASE_BLOCK)
+    {
+        struct cache_entry *e = find(cache, block);
+
+        if (!e || e->state != CACHE_VALID || e->lease_end <= now)
+        {
+            pthread_mutex_unlock(&cache->lock);
+            return false;
+        }
+    }
+
+    for (uint64_t block = first; block < addr + len; block += LEASE_BLOCK)
+    {
+        struct cache_entry *e = find(cache, block);
+        uint64_t start = block > addr ? block : addr;
+        uint64_t end = block + LEASE_BLOCK < addr + len ? block + LEASE_BLOCK : addr + len;
+
+        memcpy(dst + (start - addr), read_cache_slot(cache, e - cache->entries) + (start - block),
+               end - start);
+        e->referenced = true;
+    }
+    cache->hits++;
+    pthread_mutex_unlock(&cache->lock);
+
+    return true;
+}
+
+void read_cache_invalidate(struct read_cache *cache, uint64_t addr, size_t len)
+{
+    uint64_t first = addr - addr % LEASE_BLOCK;
+
+    if (!len)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    // a write bigger than the cache is cheaper to check slot by slot
+    if (len / LEASE_BLOCK > cache->slot_count)
+    {
+        for (int i = 0; i < cache->slot_count; i++)
+        {
+            struct cache_entry *e = &cache->entries[i];
+
+            if (e->state == CACHE_FILLING && e->addr >= first && e->addr < addr + len)
+            {
+                e->dropped = true;
+            }
+            else if (e->state == CACHE_VALID && e->addr >= first && e->addr < addr + len)
+            {
+                unlink_entry(cache, i);
+            }
+        }
+    }
+    else
+    {
+        for (uint64_t block = first; block < addr + len; block += LEASE_BLOCK)
+        {
+            struct cache_entry *e = find(cache, block);
+
+            if (e && e->state == CACHE_FILLING)
+            {
+                e->dropped = true;
+            }
+            else if (e)
+            {
+                unlink_entry(cache, e - cache->entries);
+            }
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int read_cache_reserve(struct read_cache *cache, uint64_t block_addr, uint64_t lease_ms,
+                       uint32_t *version)
+{
+    struct cache_entry *e;
+    int slot = -1;
+
+    pthread_mutex_lock(&cache->lock);
+    e = find(cache, block_addr);
+    if (e && e->state == CACHE_VALID)
+    {
+        // expired, or its lease ran out since the caller missed
+        slot = e - cache->entries;
+    }
+    else if (!e && (slot = evict(cache)) >= 0)
+    {
+        e = &cache->entries[slot];
+        e->addr = block_addr;
+        e->version = 0;
+        e->referenced = false;
+        link_entry(cache, slot);
+    }
+
+    if (slot >= 0)
+    {
+        e->state = CACHE_FILLING;
+        e->dropped = false;
+        e->lease_end = now_ns() + lease_ms * 1000000;
+        *version = e->version;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return slot;
+}
+
+void *read_cache_slot(struct read_cache *cache, int slot)
+{
+    return cache->slots + (size_t)slot * LEASE_BLOCK;
+}
+
+uint64_t read_cache_key(struct read_cache *cache)
+{
+    return fi_mr_key(get_cache_mr());
+}
+
+uint64_t read_cache_slot_addr(struct read_cache *cache, int slot)
+{
+    return get_cache_offset(read_cache_slot(cache, slot));
+}
+
+void read_cache_fill_done(struct read_cache *cache, int slot, int status, uint32_t version,
+                          size_t off, void *buf, size_t len)
+{
+    struct cache_entry *e = &cache->entries[slot];
+
+    pthread_mutex_lock(&cache->lock);
+    if (!status)
+    {
+        memcpy(buf, read_cache_slot(cache, slot) + off, len);
+    }
+
+    if (!status && version && !e->dropped)
+    {
+        if (version == e->version)
+        {
+            cache->revalidated++;
+        }
+        else
+        {
+            cache->fills++;
+        }
+        e->version = version;
+        e->state = CACHE_VALID;
+    }
+    else
+    {
+        unlink_entry(cache, slot);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
@@ -0,0 +1,251 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "client_pool.h"
+#include "config.h"
+#include "fault.h"
+#include "mem.h"
+#include "network.h"
+
+#define SELFTEST_OPS 256
+// ops span up to three stripes so they exercise striping too
+#define SELFTEST_MAX_LEN (3 * BULK_SIZE)
+#define SELFTEST_BASE_ADDR 0x1000000
+#define SELFTEST_SEED 0x5eed
+// every op has to have called back by then
+#define SELFTEST_DEADLINE_S 30
+// short enough that the clean rounds can sit out an idle reclaim, see cmd_rx_shrink
+#define SELFTEST_IDLE_TIMEOUT_S 1
+
+struct selftest_phase
+{
+    const char *name;
+    // client side, parts per million for each fault_type. The server only gets the eagain and
+    // delay rates, a server side failure looks the same to the client as a shutdown
+    unsigned ppm[FAULT_TYPES];
+    // no fault that loses anything, so every op has to succeed and read back what was written
+    bool strict;
+};
+
+static const struct selftest_phase selftest_phases[] = {
+    {"clean", {0}, true},
+    {"eagain", {[FAULT_EAGAIN] = 200000}, true},
+    {"delay", {[FAULT_DELAY] = 200000}, true},
+    {"cq_error", {[FAULT_CQ_ERROR] = 5000}, false},
+    {"shutdown", {[FAULT_SHUTDOWN] = 5000}, false},
+    {"mixed",
+     {[FAULT_EAGAIN] = 100000, [FAULT_DELAY] = 100000, [FAULT_CQ_ERROR] = 2000,
+      [FAULT_SHUTDOWN] = 2000},
+     false},
+};
+
+struct selftest_counts
+{
+    int done;
+    int failed;
+    // statuses that are neither 0 nor a negative fi_errno
+    int bad;
+};
+
+static void selftest_done(int status, void *arg)
+{
+    struct selftest_counts *counts = arg;
+
+    if (status)
+    {
+        __atomic_add_fetch(status < 0 ? &counts->failed : &counts->bad, 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_add_fetch(&counts->done, 1, __ATOMIC_SEQ_CST);
+}
+
+static size_t selftest_len(int i)
+{
+    return 1 + (i * 2654435761u) % SELFTEST_MAX_LEN;
+}
+
+// false if some op never called back, the pool can't be closed then
+static bool selftest_wait(struct selftest_counts *counts)
+{
+    time_t deadline = time(NULL) + SELFTEST_DEADLINE_S;
+
+    while (__atomic_load_n(&counts->done, __ATOMIC_SEQ_CST) < SELFTEST_OPS)
+    {
+        if (time(NULL) > deadline)
+        {
+            fprintf(stderr, "selftest: %d of %d ops stranded\n",
+                    SELFTEST_OPS - __atomic_load_n(&counts->done, __ATOMIC_SEQ_CST),
+                    SELFTEST_OPS);
+            return false;
+        }
+        usleep(1000);
+    }
+
+    return true;
+}
+
+// writes then reads back SELFTEST_OPS ops, all in flight at once. With idle set the pool sits
+// idle in between for long enough that the server shrinks its connections. Returns the number of
+// problems, or -1 if ops were stranded
+static int selftest_round(const struct net_config *cfg, const char *name, bool strict, bool idle)
+{
+    struct client_pool_attr attr = {
+        .cxns_per_server = 4,
+        .layout = LAYOUT_STRIPED,
+        .net = cfg,
+        // faults live on the fabric path
+        .no_local_path = true,
+    };
+    struct selftest_counts writes = {0};
+    struct selftest_counts reads = {0};
+    struct client_pool *pool;
+    char *out = malloc(SELFTEST_OPS * SELFTEST_MAX_LEN);
+    char *in = calloc(SELFTEST_OPS, SELFTEST_MAX_LEN);
+    int problems = 0;
+
+    pool = connect_forked_server(cfg, &attr);
+    if (!pool)
+    {
+        fprintf(stderr, "selftest %s: unable to connect\n", name);
+        problems = 1;
+        goto done;
+    }
+
+    for (int i = 0; i < SELFTEST_OPS * SELFTEST_MAX_LEN; i++)
+    {
+        out[i] = rand();
+    }
+
+    for (int i = 0; i < SELFTEST_OPS; i++)
+    {
+        client_write_async(pool, SELFTEST_BASE_ADDR + i * SELFTEST_MAX_LEN,
+                           out + i * SELFTEST_MAX_LEN, selftest_len(i), selftest_done, &writes);
+    }
+    if (!selftest_wait(&writes))
+    {
+        // the stranded pool is left open, run_selftest stops after this round
+        problems = -1;
+        goto done;
+    }
+
+    if (idle)
+    {
+        // the server checks once a second
+        sleep(cfg->idle_timeout + 2);
+    }
+
+    for (int i = 0; i < SELFTEST_OPS; i++)
+    {
+        client_read_async(pool, SELFTEST_BASE_ADDR + i * SELFTEST_MAX_LEN,
+                          in + i * SELFTEST_MAX_LEN, selftest_len(i), selftest_done, &reads);
+    }
+    if (!selftest_wait(&reads))
+    {
+        problems = -1;
+        goto done;
+    }
+
+    client_pool_close(pool);
+
+    problems = writes.bad + reads.bad;
+    if (strict)
+    {
+        problems += writes.failed + reads.failed;
+        for (int i = 0; i < SELFTEST_OPS; i++)
+        {
+            if (memcmp(in + i * SELFTEST_MAX_LEN, out + i * SELFTEST_MAX_LEN, selftest_len(i)))
+            {
+                problems++;
+            }
+        }
+    }
+
+    printf("selftest %s: %d writes failed, %d reads failed, %d problems\n", name, writes.failed,
+           reads.failed, problems);
+
+done:
+    free(out);
+    free(in);
+
+    return problems;
+}
+
+/*
+Runs a server in a child process and drives a client pool at it while injecting faults. For each
+phase the client round has to have every op call back, succeeding or failing with a negative
+fi_errno, and phases without lossy faults have to read back what they wrote. A clean round
+against the same server follows, so a server that mishandled the faulty one shows up there. It
+idles between its writes and reads, so the reads also go over connections the server shrank.
+*/
+int run_selftest(const struct net_config *base)
+{
+    int failures = 0;
+
+    for (int i = 0; i < sizeof(selftest_phases) / sizeof(*selftest_phases); i++)
+    {
+        const struct selftest_phase *phase = &selftest_phases[i];
+        struct net_config cfg = *base;
+        char name[64];
+        int rc;
+        int clean_rc = 0;
+        pid_t pid;
+
+        // see fork_server
+        cfg.port = base->port + 1 + i;
+        cfg.verify = true;
+        cfg.idle_timeout = SELFTEST_IDLE_TIMEOUT_S;
+
+        fault_clear();
+        fault_seed(SELFTEST_SEED + 2 * i);
+        fault_set(FAULT_EAGAIN, phase->ppm[FAULT_EAGAIN]);
+        fault_set(FAULT_DELAY, phase->ppm[FAULT_DELAY]);
+
+        pid = fork_server(&cfg);
+        if (pid < 0)
+        {
+            fprintf(stderr, "selftest: fork failed\n");
+            return 1;
+        }
+
+        fault_seed(SELFTEST_SEED + 2 * i + 1);
+        for (int type = 0; type < FAULT_TYPES; type++)
+        {
+            fault_set(type, phase->ppm[type]);
+        }
+
+        rc = selftest_round(&cfg, phase->name, phase->strict, false);
+        printf("selftest %s: injected", phase->name);
+        for (int type = 0; type < FAULT_TYPES; type++)
+        {
+            printf(" %s %llu", fault_name(type), (unsigned long long)fault_count(type));
+        }
+        printf("\n");
+
+        if (rc >= 0)
+        {
+            fault_clear();
+            snprintf(name, sizeof(name), "%s, then clean", phase->name);
+            clean_rc = selftest_round(&cfg, name, true, true);
+        }
+
+        stop_forked_server(pid);
+
+        if (rc < 0 || clean_rc < 0)
+        {
+            // the stranded pool can't be closed
+            printf("selftest %s: FAIL, ops stranded\n", phase->name);
+            return 1;
+        }
+
+        printf("selftest %s: %s\n", phase->name, rc || clean_rc ? "FAIL" : "ok");
+        failures += rc || clean_rc;
+    }
+
+    fault_clear();
+    printf("selftest: %d of %zu phases failed\n", failures,
+           sizeof(selftest_phases) / sizeof(*selftest_phases));
+
+    return failures ? 1 : 0;
+}
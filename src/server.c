@@ -3,20 +3,30 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 
 #include <rdma/fabric.h>
 #include <rdma/fi_cm.h>
 #include <rdma/fi_domain.h>
 #include <rdma/fi_endpoint.h>
+#include <rdma/fi_eq.h>
 #include <rdma/fi_rma.h>
 
+#include "client_pool.h"
+#include "crc32c.h"
 #include "log.h"
+#include "lz.h"
 #include "mem.h"
 #include "network.h"
+#include "persist.h"
+#include "prof.h"
+#include "qos.h"
 
 void process_cmd(struct network_request *rq);
 
@@ -47,10 +57,23 @@ int init_server(struct net_info *ni)
 {
     int rc;
 
+    rc = init_store(ni, STORE_SIZE);
+    if (rc < 0)
+    {
+        GOTO(err, "init_store");
+    }
+
+    // sized for the active connections, idle ones have nothing outstanding
+    rc = open_cq(ni, ni->cq_size * MAX_CONNECTIONS, &ni->cq);
+    if (rc < 0)
+    {
+        FI_GOTO(err1, "fi_cq_open");
+    }
+
     rc = fi_passive_ep(ni->fabric, ni->fi, &ni->pep, NULL);
     if (rc < 0)
     {
-        FI_GOTO(err1, "fi_passive_ep");
+        FI_GOTO(err2, "fi_passive_ep");
     }
 
     print_ep_name(ni->pep);
@@ -58,35 +81,29 @@ int init_server(struct net_info *ni)
     rc = fi_pep_bind(ni->pep, (fid_t)ni->eq, 0);
     if (rc < 0)
     {
-        FI_GOTO(err2, "fi_pep_bind");
+        FI_GOTO(err3, "fi_pep_bind");
     }
 
     rc = fi_listen(ni->pep);
     if (rc < 0)
     {
-        FI_GOTO(err2, "fi_listen");
+        FI_GOTO(err3, "fi_listen");
     }
 
     return 0;
 
-err2:
+err3:
     fi_close((fid_t)ni->pep);
+err2:
+    fi_close((fid_t)ni->cq);
+    ni->cq = NULL;
 err1:
+    close_store(ni);
     fi_close((fid_t)ni->domain);
 err:
     return rc;
 }
 
-void close_connection(struct connection *cxn)
-{
-    // tcp provider doesn't like having the cq closed before the ep
-    fi_close((fid_t)cxn->ep);
-    fi_close((fid_t)cxn->cq);
-
-    free_bulk_buf(cxn->bulk_buf);
-    free_cmd_buf(cxn->cmd_buf);
-}
-
 void close_server(struct net_info *ni)
 {
     while (ni->connection_list)
@@ -99,9 +116,13 @@ void close_server(struct net_info *ni)
     }
 
     fi_close((fid_t)ni->pep);
+    fi_close((fid_t)ni->cq);
+    ni->cq = NULL;
+    close_store(ni);
 }
 
-int add_connection(struct net_info *ni, struct fi_eq_cm_entry *cm_entry)
+int add_connection(struct net_info *ni, struct fi_eq_cm_entry *cm_entry,
+                   struct network_handshake *keys)
 {
 
     if (!cm_entry->info->domain_attr->domain && ni->domain)
@@ -115,24 +136,58 @@ int add_connection(struct net_info *ni, struct fi_eq_cm_entry *cm_entry)
     }
 
     struct connection *cxn;
+    struct network_handshake reply = ni->local_keys;
 
     int rc = setup_connection(ni, &cxn, cm_entry->info);
     if (rc < 0)
     {
+        fi_reject(ni->pep, cm_entry->info->handle, NULL, 0);
         FI_GOTO(done, "setup_connection");
     }
 
-    // XXX this should probably be stored in the connection so we can free it on disconnect
-    struct network_request *rq = malloc(sizeof(struct network_request));
+    // the client tells us how many replies it can take before reposting
+    cxn->send_credits = keys ? keys->rx_depth : 1;
+    if (keys)
+    {
+        cxn->remote_keys = *keys;
+    }
+
+    if (keys && (keys->features & FEATURE_DIRECT_STORE) && !persist_enabled() && !store_leases())
+    {
+        reply.features |= FEATURE_DIRECT_STORE;
+    }
+    if (keys && (keys->features & FEATURE_LEASE) && store_leases())
+    {
+        reply.features |= FEATURE_LEASE;
+        reply.lease_ms = ni->cfg.lease_ms;
+    }
+    if (is_store_read_only())
+    {
+        reply.features |= FEATURE_STORE_READ_ONLY;
+    }
+    if (keys && (keys->features & FEATURE_RECLAIM))
+    {
+        reply.features |= FEATURE_RECLAIM;
+    }
+
+    // compressed data is staged in a bulk buffer, without a free one the client sends it raw
+    if (keys && (keys->features & FEATURE_LZ) && (cxn->bulk_buf = alloc_bulk_buf()))
+    {
+        reply.features |= FEATURE_LZ;
+    }
+
+    struct network_request *rq = &cxn->cmd_rq;
     rq->cxn = cxn;
     rq->callback = process_cmd;
 
     // libfabric doesn't give us an event notification for the client send unless there's a buffer
     // posted
     cmd_recv(rq);
+    post_flush(cxn);
 
     printf("accepting\n");
-    rc = fi_accept(cxn->ep, NULL, 0);
+    // the client needs our bulk key to target it with native atomics
+    rc = fi_accept(cxn->ep, &reply, sizeof(reply));
     if (rc < 0)
     {
         FI_GOTO(done, "fi_accept");
@@ -142,6 +197,23 @@ done:
     return rc;
 }
 
+// *cxn_ptr is the list link pointing at the connection
+static void remove_connection(struct net_info *ni, struct connection **cxn_ptr)
+{
+    struct connection *cxn = *cxn_ptr;
+
+    printf("deleting client %d\n", cxn->client_id);
+    *cxn_ptr = cxn->next;
+
+    qos_forget(cxn);
+
+    // the shared cq may still hold completions pointing into cxn
+    cxn->closing = true;
+    close_connection(cxn);
+    process_all_cq_events(ni);
+    free(cxn);
+}
+
 int del_connection(struct net_info *ni, struct fi_eq_cm_entry *cm_entry)
 {
     struct connection *cxn = ni->connection_list;
@@ -150,10 +222,7 @@ int del_connection(struct net_info *ni, struct fi_eq_cm_entry *cm_entry)
     {
         if ((fid_t)cxn->ep == cm_entry->fid)
         {
-            printf("deleting client %d\n", cxn->client_id);
-            *cxn_ptr = cxn->next;
-            close_connection(cxn);
-            free(cxn);
+            remove_connection(ni, cxn_ptr);
 
             return 0;
         }
@@ -167,15 +236,58 @@ int del_connection(struct net_info *ni, struct fi_eq_cm_entry *cm_entry)
     return -ENOENT;
 }
 
+// connections we shut down ourselves get no FI_SHUTDOWN event
+static void reap_failed_connections(struct net_info *ni)
+{
+    struct connection **cxn_ptr = &ni->connection_list;
+
+    while (*cxn_ptr)
+    {
+        if ((*cxn_ptr)->failed)
+        {
+            remove_connection(ni, cxn_ptr);
+        }
+        else
+        {
+            cxn_ptr = &(*cxn_ptr)->next;
+        }
+    }
+}
+
+// posts waiting on provider resources, or completions held back, need another pass soon
+static bool server_backlog(struct net_info *ni)
+{
+    if (ni->delayed_head)
+    {
+        return true;
+    }
+
+    for (struct connection *cxn = ni->connection_list; cxn; cxn = cxn->next)
+    {
+        if (cxn->pending_head)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void process_eq_events(struct net_info *ni)
 {
     uint32_t event;
-    struct fi_eq_cm_entry cm_entry;
+    struct
+    {
+        struct fi_eq_cm_entry cm_entry;
+        struct network_handshake keys;
+    } entry;
+    struct fi_eq_cm_entry *cm_entry = &entry.cm_entry;
+    struct prof_frame frame;
     int rc;
 
     do
     {
-        rc = fi_eq_read(ni->eq, &event, &cm_entry, sizeof cm_entry, 0);
+        rc = fi_eq_read(ni->eq, &event, &entry, sizeof entry, 0);
         if (rc == -FI_EAGAIN)
         {
             return;
@@ -201,66 +313,250 @@ void process_eq_events(struct net_info *ni)
             return;
         }
 
+        if (prof_enabled)
+        {
+            prof_begin(&frame);
+        }
+
         switch (event)
         {
         case FI_CONNREQ:
             printf("Connecting...\n");
-            add_connection(ni, &cm_entry);
+            add_connection(ni, cm_entry,
+                           rc == sizeof(entry) && entry.keys.magic == MAGIC ? &entry.keys : NULL);
             break;
         case FI_CONNECTED:
             printf("Connected\n");
             break;
         case FI_SHUTDOWN:
             printf("Disconnected\n");
-            del_connection(ni, &cm_entry);
+            del_connection(ni, cm_entry);
             break;
         default:
             fprintf(stderr, "unknown event: %d - %s\n", event, fi_tostr(&event, FI_TYPE_EQ_EVENT));
             break;
         }
+
+        if (prof_enabled)
+        {
+            prof_end_eq(&frame, event);
+        }
     } while (rc != 0);
 }
 
+// a connection waiting for its next command, with nothing in flight, can give its buffers back
+static bool connection_quiet(struct connection *cxn)
+{
+    return cxn->recv_rq == &cxn->cmd_rq && cxn->rx_ready_count == 0 && !cxn->pending_head &&
+           cxn->post_queue.count == 0;
+}
+
+static void reclaim_idle_connections(struct net_info *ni)
+{
+    static time_t last_check;
+    time_t now = time(NULL);
+
+    if (ni->cfg.idle_timeout == 0 || now == last_check)
+    {
+        return;
+    }
+    last_check = now;
+
+    for (struct connection *cxn = ni->connection_list; cxn; cxn = cxn->next)
+    {
+        if (!cxn->idle && now - cxn->last_active >= ni->cfg.idle_timeout &&
+            connection_quiet(cxn) && cmd_rx_shrink(cxn))
+        {
+            printf("client %d idle, releasing buffers\n", cxn->client_id);
+        }
+    }
+}
+
 bool keep_running = 1;
 void handle_sigint()
 {
     keep_running = 0;
 }
 
+static void handle_sigusr1()
+{
+    prof_request_dump();
+}
+
+int server_wait_fd(struct net_info *ni)
+{
+    return ni->wait_fd;
+}
+
+void server_progress(struct net_info *ni)
+{
+    process_eq_events(ni);
+    process_all_cq_events(ni);
+    // commands that arrived while draining start in their turn
+    if (qos_dispatch(ni))
+    {
+        post_flush_all(ni);
+    }
+    reap_failed_connections(ni);
+    reclaim_idle_connections(ni);
+    persist_progress();
+    prof_poll();
+}
+
+// the wait set covers the eq and every cq, so checking it arms all of them
+int server_trywait(struct net_info *ni)
+{
+    struct fid *fids[] = {&ni->wait_set->fid};
+
+    return fi_trywait(ni->fabric, fids, 1);
+}
+
+// retry anything still blocked on provider resources and keep writing dirty pages behind soon,
+// otherwise wake up for idle checks
+int server_wait_timeout(struct net_info *ni)
+{
+    return server_backlog(ni) || persist_busy() ? 1 : 1000;
+}
+
+static int open_epoll(struct net_info *ni)
+{
+    struct epoll_event ev = {.events = EPOLLIN};
+    int epfd;
+
+    if (ni->wait_fd < 0)
+    {
+        return -1;
+    }
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd >= 0 && epoll_ctl(epfd, EPOLL_CTL_ADD, ni->wait_fd, &ev) < 0)
+    {
+        close(epfd);
+        epfd = -1;
+    }
+
+    return epfd;
+}
+
+// the same loop an embedding reactor runs, with fi_wait for providers without a wait fd
 int run_server(struct net_info *ni)
 {
+    int epfd = open_epoll(ni);
+
+    printf("waiting with %s\n", epfd >= 0 ? "epoll" : "fi_wait");
+
     signal(SIGINT, handle_sigint);
+    if (prof_enabled)
+    {
+        signal(SIGUSR1, handle_sigusr1);
+    }
     while (keep_running)
     {
+        struct epoll_event ev;
         int rc;
 
-        rc = fi_wait(ni->wait_set, 1000);
+        server_progress(ni);
 
-        if (rc == -FI_ETIMEDOUT)
+        if (epfd < 0)
+        {
+            rc = fi_wait(ni->wait_set, server_wait_timeout(ni));
+            if (rc < 0 && rc != -FI_ETIMEDOUT)
+            {
+                fprintf(stderr, "Error waiting: %d\n", rc);
+            }
+            continue;
+        }
+
+        rc = server_trywait(ni);
+        if (rc == -FI_EAGAIN)
         {
             continue;
         }
         else if (rc < 0)
         {
-            fprintf(stderr, "Error waiting: %d\n", rc);
+            fprintf(stderr, "fi_trywait: %s, falling back to fi_wait\n", fi_strerror(-rc));
+            close(epfd);
+            epfd = -1;
             continue;
         }
 
-        printf("Got event\n");
-        process_eq_events(ni);
-        process_all_cq_events(ni);
+        // EINTR from SIGINT lands back at the keep_running check
+        epoll_wait(epfd, &ev, 1, server_wait_timeout(ni));
+    }
+
+    if (epfd >= 0)
+    {
+        close(epfd);
+    }
+
+    prof_dump(stderr);
+
+    return 0;
+}
+
+// a failed request takes its connection down, the run loop reaps it
+static bool request_failed(struct network_request *rq)
+{
+    if (!rq->rq_res)
+    {
+        return false;
     }
+
+    fprintf(stderr, "client %d: request failed: %s\n", rq->cxn->client_id,
+            fi_strerror(-rq->rq_res));
+    connection_fail(rq->cxn, rq->rq_res);
+
+    return true;
 }
 
 void send_complete(struct network_request *rq)
 {
+    qos_done(rq->cxn);
+
+    if (request_failed(rq))
+    {
+        return;
+    }
+
     rq->callback = process_cmd;
     cmd_recv(rq);
 }
 
 void finish_get_cmd(struct network_request *rq)
 {
-    printf("finish_get_cmd: received %s\n", rq->cxn->bulk_buf);
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    void *store = get_store_ptr(cmd->op_addr, cmd->rma_iov.len);
+
+    // whatever landed is in the store, even if the read failed, and the file has to follow it.
+    // A decompressed GET lands below, before the write-behind gets to run
+    store_write_end(cmd->op_addr, cmd->rma_iov.len);
+    persist_dirty(cmd->op_addr, cmd->rma_iov.len);
+
+    if (request_failed(rq))
+    {
+        return;
+    }
+
+    if ((cmd->flags & CMD_FLAG_LZ) &&
+        lz_decompress(rq->cxn->bulk_buf, cmd->lz_len, store, cmd->rma_iov.len) !=
+            cmd->rma_iov.len)
+    {
+        fprintf(stderr, "bad compressed GET at %llx, %u bytes\n",
+                (unsigned long long)cmd->op_addr, cmd->lz_len);
+        cmd->status = -FI_EIO;
+    }
+
+    TRACE("finish_get_cmd: stored %u bytes at %llx\n", cmd->rma_iov.len,
+          (unsigned long long)cmd->op_addr);
+
+    // the data is already in the store, a mismatch only tells the client to send it again
+    if (!cmd->status && (cmd->flags & CMD_FLAG_CRC) &&
+        crc32c(0, store, cmd->rma_iov.len) != cmd->crc)
+    {
+        fprintf(stderr, "crc mismatch on GET at %llx, len %u\n",
+                (unsigned long long)cmd->op_addr, cmd->rma_iov.len);
+        cmd->status = -FI_EIO;
+    }
 
     rq->callback = send_complete;
     cmd_send(rq);
@@ -268,28 +564,430 @@ void finish_get_cmd(struct network_request *rq)
 
 void finish_put_cmd(struct network_request *rq)
 {
-    printf("finish_put_cmd: sent data\n");
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+
+    if (request_failed(rq))
+    {
+        return;
+    }
+
+    // a write that started while the block was going out may have torn it
+    if ((cmd->flags & CMD_FLAG_LEASE) && store_version(cmd->op_addr) != cmd->version)
+    {
+        cmd->version = 0;
+    }
+
+    TRACE("finish_put_cmd: sent data\n");
 
     rq->callback = send_complete;
     cmd_send(rq);
 }
 
-void process_cmd(struct network_request *rq)
+void finish_batch(struct network_request *rq)
 {
     struct network_cmd *cmd = rq->cxn->cmd_buf;
-    cmd->rma.rma_iov = &cmd->rma_iov;
-    cmd->rma.rma_iov_count = 1;
 
-    printf("process_cmd, type %d\n", cmd->type);
+    if (--rq->rq_pending > 0)
+    {
+        return;
+    }
+
+    for (uint32_t i = 0; i < cmd->batch_count; i++)
+    {
+        // like finish_get_cmd, even when the batch failed
+        if (cmd->batch[i].type == GET)
+        {
+            store_write_end(cmd->batch[i].op_addr, cmd->batch[i].rma_iov.len);
+            persist_dirty(cmd->batch[i].op_addr, cmd->batch[i].rma_iov.len);
+        }
+    }
+
+    if (request_failed(rq))
+    {
+        return;
+    }
+
+    TRACE("finish_batch: %u ops\n", cmd->batch_count);
+
+    // one reply for the whole batch
+    rq->callback = send_complete;
+    cmd_send(rq);
+}
+
+static void start_batch(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+
+    rq->rq_pending = cmd->batch_count;
+    rq->callback = finish_batch;
+
+    for (uint32_t i = 0; i < cmd->batch_count; i++)
+    {
+        struct network_batch_entry *entry = &cmd->batch[i];
+        struct fi_rma_iov rma_iov = cmd_rma_iov(&entry->rma_iov);
+        struct fi_msg_rma msg = {
+            .rma_iov = &rma_iov,
+            .rma_iov_count = 1,
+        };
+
+        if (entry->type == GET)
+        {
+            store_write_begin(entry->op_addr, entry->rma_iov.len);
+        }
+        bulk_op(rq, &msg, get_store_ptr(entry->op_addr, entry->rma_iov.len), entry->rma_iov.len,
+                entry->type == GET, 0);
+    }
+}
+
+// every entry moves data directly between the client buffer and the store, the RMAs are queued
+// back to back and flushed together so the provider can coalesce them
+void process_batch(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    size_t bytes = 0;
+
+    cmd->status = 0;
+    if (cmd->batch_count > MAX_BATCH)
+    {
+        cmd->status = -FI_EINVAL;
+    }
+
+    for (uint32_t i = 0; !cmd->status && i < cmd->batch_count; i++)
+    {
+        struct network_batch_entry *entry = &cmd->batch[i];
+
+        if (entry->type != GET && entry->type != PUT)
+        {
+            cmd->status = -FI_EINVAL;
+        }
+        else if (!get_store_ptr(entry->op_addr, entry->rma_iov.len))
+        {
+            cmd->status = -FI_ERANGE;
+        }
+        else if (entry->type == GET && is_store_read_only())
+        {
+            cmd->status = -FI_EACCES;
+        }
+        else
+        {
+            cmd->status = persist_fault_in(entry->op_addr, entry->rma_iov.len);
+        }
+    }
+
+    if (cmd->status || cmd->batch_count == 0)
+    {
+        fprintf(stderr, "rejecting batch of %u: %d\n", cmd->batch_count, cmd->status);
+        cmd->batch_count = 0;
+        rq->callback = send_complete;
+        cmd_send(rq);
+        return;
+    }
+
+    for (uint32_t i = 0; i < cmd->batch_count; i++)
+    {
+        bytes += cmd->batch[i].rma_iov.len;
+    }
+
+    rq->callback = start_batch;
+    qos_submit(rq, bytes);
+}
+
+/*
+Used by clients without native atomics, or whose server store isn't directly writable. The op is
+applied with CPU atomics, so it's atomic with respect to other emulated atomics only. Other
+writers of the same word aren't serialized against it: GETs landing by RMA, same-host clients
+copying into the shared store, and clients that do have native atomics, the NIC's and the CPU's
+don't exclude each other. The shared store isn't refused over it, emulation is chosen per client
+when it connects, long after the store has been handed out. Clients mixing atomics with plain
+writes to a word have to order those themselves.
+*/
+void emulate_atomic(struct network_cmd *cmd)
+{
+    uint64_t *target = get_store_ptr(cmd->op_addr, sizeof(uint64_t));
+
+    if (!target || cmd->op_addr % sizeof(uint64_t))
+    {
+        fprintf(stderr, "bad atomic address: %llx\n", (unsigned long long)cmd->op_addr);
+        cmd->status = -FI_EINVAL;
+        return;
+    }
+
+    if (is_store_read_only())
+    {
+        cmd->status = -FI_EACCES;
+        return;
+    }
+
+    cmd->status = persist_fault_in(cmd->op_addr, sizeof(uint64_t));
+    if (cmd->status)
+    {
+        return;
+    }
+    persist_dirty(cmd->op_addr, sizeof(uint64_t));
+
+    store_write_begin(cmd->op_addr, sizeof(uint64_t));
+    if (cmd->type == FETCH_ADD)
+    {
+        cmd->result = __atomic_fetch_add(target, cmd->operand, __ATOMIC_SEQ_CST);
+    }
+    else
+    {
+        cmd->result = cmd->compare;
+        __atomic_compare_exchange_n(target, &cmd->result, cmd->operand, false, __ATOMIC_SEQ_CST,
+                                    __ATOMIC_SEQ_CST);
+    }
+    store_write_end(cmd->op_addr, sizeof(uint64_t));
+}
+
+static bool lz_cmd_ok(struct connection *cxn, struct network_cmd *cmd)
+{
+    if (!(cmd->flags & CMD_FLAG_LZ))
+    {
+        return true;
+    }
+
+    // only connections that agreed to FEATURE_LZ have a buffer to stage it in
+    return cxn->bulk_buf && (cmd->type != GET || (cmd->lz_len && cmd->lz_len <= BULK_SIZE));
+}
+
+static bool lease_cmd_ok(struct network_cmd *cmd)
+{
+    if (!(cmd->flags & CMD_FLAG_LEASE))
+    {
+        return true;
+    }
+
+    return store_leases() && cmd->type == PUT && !(cmd->flags & CMD_FLAG_LZ) &&
+           cmd->op_addr % LEASE_BLOCK == 0 && cmd->rma_iov.len == LEASE_BLOCK;
+}
+
+// writes the store range to the client, compressed through our bulk buffer if the client asked
+// for it and the range compresses
+static void start_put(struct network_request *rq, void *store)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    struct fi_rma_iov wire = cmd_rma_iov(&cmd->rma_iov);
+    struct fi_msg_rma msg = {.rma_iov = &wire, .rma_iov_count = 1};
+    bool imm = (cmd->flags & CMD_FLAG_IMM) && rq->cxn->ni->remote_cq_data;
+    void *src = store;
+
+    if (cmd->flags & CMD_FLAG_CRC)
+    {
+        cmd->crc = crc32c(0, store, cmd->rma_iov.len);
+    }
+
+    if (cmd->flags & CMD_FLAG_LEASE)
+    {
+        uint32_t version = store_version(cmd->op_addr);
+
+        // the client's copy is current, only the reply goes back
+        if (version && version == cmd->version)
+        {
+            rq->callback = send_complete;
+            cmd_send(rq);
+            return;
+        }
+
+        // replied to, so finish_put_cmd can check the version again
+        cmd->version = version;
+        rq->callback = finish_put_cmd;
+        bulk_write(rq, &msg, store, cmd->rma_iov.len);
+        return;
+    }
+
+    cmd->lz_len = 0;
+    if (cmd->flags & CMD_FLAG_LZ)
+    {
+        size_t cap = lz_target(cmd->rma_iov.len);
+
+        cmd->lz_len = lz_compress(store, cmd->rma_iov.len, rq->cxn->bulk_buf,
+                                  cap < BULK_SIZE ? cap : BULK_SIZE);
+        if (cmd->lz_len)
+        {
+            src = rq->cxn->bulk_buf;
+            wire.len = cmd->lz_len;
+        }
+
+        // the client can only find lz_len in 8 bytes of immediate data, otherwise it's replied
+        imm = imm && (!cmd->lz_len ||
+                      rq->cxn->ni->fi->domain_attr->cq_data_size >= sizeof(uint64_t));
+    }
+
+    if (imm)
+    {
+        uint64_t data = cmd->op_addr;
+
+        if (cmd->flags & (CMD_FLAG_CRC | CMD_FLAG_LZ))
+        {
+            data = (uint64_t)cmd->lz_len << 32 | cmd->crc;
+        }
+
+        // the client is notified by the write itself, so no reply message is needed
+        rq->callback = send_complete;
+        bulk_write_imm(rq, &msg, src, wire.len, data);
+    }
+    else
+    {
+        rq->callback = finish_put_cmd;
+        bulk_write(rq, &msg, src, wire.len);
+    }
+}
+
+// a checked GET or PUT, once the scheduler gets to it
+static void start_cmd(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    void *store = get_store_ptr(cmd->op_addr, cmd->rma_iov.len);
+
     if (cmd->type == GET)
     {
+        struct fi_rma_iov wire = cmd_rma_iov(&cmd->rma_iov);
+        struct fi_msg_rma msg = {.rma_iov = &wire, .rma_iov_count = 1};
+
         rq->callback = finish_get_cmd;
-        bulk_read(rq, &cmd->rma);
+        store_write_begin(cmd->op_addr, cmd->rma_iov.len);
+        if (cmd->flags & CMD_FLAG_LZ)
+        {
+            // staged in our bulk buffer, finish_get_cmd expands it into the store
+            wire.len = cmd->lz_len;
+            bulk_read(rq, &msg, rq->cxn->bulk_buf, cmd->lz_len);
+        }
+        else
+        {
+            bulk_read(rq, &msg, store, cmd->rma_iov.len);
+        }
     }
     else
     {
-        sprintf(rq->cxn->bulk_buf, "Hello world from the server, addr: %x\n", cmd->op_addr);
-        rq->callback = finish_put_cmd;
-        bulk_write(rq, &cmd->rma);
+        start_put(rq, store);
+    }
+}
+
+// GET and PUT are from the server's point of view: GET reads the client buffer into the store at
+// op_addr, PUT writes the store at op_addr out to the client buffer
+void process_cmd(struct network_request *rq)
+{
+    struct network_cmd *cmd = rq->cxn->cmd_buf;
+    void *store;
+
+    if (request_failed(rq))
+    {
+        return;
+    }
+
+    cmd->status = 0;
+
+    TRACE("process_cmd, type %d\n", cmd->type);
+    if (cmd->type == FETCH_ADD || cmd->type == COMPARE_SWAP)
+    {
+        emulate_atomic(cmd);
+
+        rq->callback = send_complete;
+        cmd_send(rq);
+        return;
     }
+    else if (cmd->type == BATCH)
+    {
+        process_batch(rq);
+        return;
+    }
+
+    store = get_store_ptr(cmd->op_addr, cmd->rma_iov.len);
+    if (!store || (cmd->type != GET && cmd->type != PUT) || !lz_cmd_ok(rq->cxn, cmd) ||
+        !lease_cmd_ok(cmd) || (cmd->type == GET && is_store_read_only()))
+    {
+        fprintf(stderr, "rejecting cmd %d at %llx, len %u\n", cmd->type,
+                (unsigned long long)cmd->op_addr, cmd->rma_iov.len);
+        cmd->status = -FI_EINVAL;
+        if (!store)
+        {
+            cmd->status = -FI_ERANGE;
+        }
+        else if (cmd->type == GET && is_store_read_only())
+        {
+            cmd->status = -FI_EACCES;
+        }
+
+        rq->callback = send_complete;
+        cmd_send(rq);
+    }
+    // pages only in the persistence file are read back before any data moves
+    else if ((cmd->status = persist_fault_in(cmd->op_addr, cmd->rma_iov.len)))
+    {
+        rq->callback = send_complete;
+        cmd_send(rq);
+    }
+    else
+    {
+        rq->callback = start_cmd;
+        qos_submit(rq, cmd->rma_iov.len);
+    }
+}
+
+// _exit skips the handler that writes an instrumented build's profile. Both calls shape the code
+// the same, a PGO build has to match the profile it was trained on
+#ifdef PGO_GENERATE
+#define child_exit exit
+#else
+#define child_exit _exit
+#endif
+
+// a server listening on cfg's port in a child process, until it gets SIGINT. Its stdout is
+// dropped to keep the caller's output readable. Callers forking one after another should move to
+// a fresh port each time, the last server's may still be in TIME_WAIT
+pid_t fork_server(const struct net_config *cfg)
+{
+    pid_t pid = fork();
+
+    if (pid == 0)
+    {
+        struct net_info ni;
+        int rc;
+
+        freopen("/dev/null", "w", stdout);
+
+        rc = init_network(&ni, true, cfg);
+        if (rc == 0)
+        {
+            rc = init_server(&ni);
+            if (rc == 0)
+            {
+                run_server(&ni);
+                close_server(&ni);
+            }
+            close_network(&ni);
+        }
+
+        child_exit(rc ? 1 : 0);
+    }
+
+    return pid;
+}
+
+// the forked server needs a moment to start listening
+#define FORK_CONNECT_TRIES 50
+#define FORK_CONNECT_DELAY_US 100000
+
+struct client_pool *connect_forked_server(const struct net_config *cfg,
+                                          const struct client_pool_attr *attr)
+{
+    struct client_server server = {.addr = cfg->addr, .port = cfg->port};
+    struct client_pool *pool = NULL;
+
+    for (int i = 0; i < FORK_CONNECT_TRIES && !pool; i++)
+    {
+        pool = client_pool_open(&server, 1, attr);
+        if (!pool)
+        {
+            usleep(FORK_CONNECT_DELAY_US);
+        }
+    }
+
+    return pool;
+}
+
+void stop_forked_server(pid_t pid)
+{
+    kill(pid, SIGINT);
+    waitpid(pid, NULL, 0);
 }
@@ -1,23 +1,787 @@
 #include <assert.h>
+#include <rdma/fi_atomic.h>
 #include <rdma/fi_rma.h>
 
+#include <rdma/fi_cm.h>
 #include <rdma/fi_endpoint.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
+#include "fault.h"
 #include "log.h"
 #include "mem.h"
 #include "network.h"
+#include "obj_pool.h"
+#include "prof.h"
 
+struct pending_op
+{
+    struct pending_op *next;
+    struct post_op op;
+};
+
+static struct obj_pool pending_pool = OBJ_POOL_INIT(struct pending_op);
+
+// a completion held back by FAULT_DELAY, cxn is the connection it belongs to
+struct delayed_completion
+{
+    struct delayed_completion *next;
+    struct connection *cxn;
+    void *context;
+    uint64_t flags;
+    uint64_t data;
+};
+
+static void run_callback(struct network_request *rq);
+static bool ctl_send(struct connection *cxn, uint8_t type, uint32_t reclaim);
+
+static bool is_rx_rq(struct connection *cxn, struct network_request *rq)
+{
+    return rq >= cxn->rx_rqs && rq < cxn->rx_rqs + MAX_RX_DEPTH;
+}
+
+static ssize_t post_op(struct connection *cxn, struct post_op *op, uint64_t flags)
+{
+    struct iovec iov = {
+        .iov_base = op->buf,
+        .iov_len = op->len,
+    };
+
+    if (op->type == POST_RECV || op->type == POST_SEND)
+    {
+        struct fi_msg msg = {
+            .msg_iov = &iov,
+            .desc = &op->desc,
+            .iov_count = 1,
+            .context = op->context,
+            .data = op->data,
+        };
+
+        if (op->type == POST_RECV)
+        {
+            return fi_recvmsg(cxn->ep, &msg, flags);
+        }
+        else
+        {
+            return fi_sendmsg(cxn->ep, &msg, flags);
+        }
+    }
+    else if (op->type == POST_FETCH_ADD || op->type == POST_COMPARE_SWAP)
+    {
+        struct network_cmd *cmd = op->buf;
+        struct fi_ioc ioc = {.addr = &cmd->operand, .count = 1};
+        struct fi_ioc result = {.addr = &cmd->result, .count = 1};
+        struct fi_ioc compare = {.addr = &cmd->compare, .count = 1};
+        struct fi_rma_ioc rma_ioc = {
+            .addr = op->rma_iov.addr,
+            .count = 1,
+            .key = op->rma_iov.key,
+        };
+        struct fi_msg_atomic msg = {
+            .msg_iov = &ioc,
+            .desc = &op->desc,
+            .iov_count = 1,
+            .rma_iov = &rma_ioc,
+            .rma_iov_count = 1,
+            .datatype = FI_UINT64,
+            .op = op->type == POST_FETCH_ADD ? FI_SUM : FI_CSWAP,
+            .context = op->context,
+        };
+
+        if (op->type == POST_FETCH_ADD)
+        {
+            return fi_fetch_atomicmsg(cxn->ep, &msg, &result, &op->desc, 1, flags);
+        }
+        else
+        {
+            return fi_compare_atomicmsg(cxn->ep, &msg, &compare, &op->desc, 1, &result,
+                                        &op->desc, 1, flags);
+        }
+    }
+    else
+    {
+        struct fi_msg_rma msg = {
+            .msg_iov = &iov,
+            .desc = &op->desc,
+            .iov_count = 1,
+            .rma_iov = &op->rma_iov,
+            .rma_iov_count = 1,
+            .context = op->context,
+            .data = op->data,
+        };
+
+        if (op->type == POST_READ)
+        {
+            return fi_readmsg(cxn->ep, &msg, flags);
+        }
+        else
+        {
+            return fi_writemsg(cxn->ep, &msg, flags);
+        }
+    }
+}
+
+// a message lands in one of the peer's posted receives, and so does RMA immediate data when the
+// provider runs in FI_RX_CQ_DATA mode
+static bool op_needs_credit(struct connection *cxn, struct post_op *op)
+{
+    if (op->type == POST_SEND)
+    {
+        return true;
+    }
+
+    return op->type == POST_WRITE && (op->flags & FI_REMOTE_CQ_DATA) &&
+           (cxn->ni->fi->mode & FI_RX_CQ_DATA);
+}
+
+static void op_list_append(struct pending_op **head, struct pending_op **tail, struct post_op *op)
+{
+    struct pending_op *pending = obj_alloc(&pending_pool);
+
+    pending->next = NULL;
+    pending->op = *op;
+
+    if (*tail)
+    {
+        (*tail)->next = pending;
+    }
+    else
+    {
+        *head = pending;
+    }
+    *tail = pending;
+}
+
+// rq's callback runs from post_flush with rq_res set to err
+static void fail_request(struct connection *cxn, struct network_request *rq, int err)
+{
+    struct post_op op = {.context = rq};
+
+    rq->rq_res = err;
+    op_list_append(&cxn->failed_head, &cxn->failed_tail, &op);
+}
+
+// receives into rx slots have no request to tell
+static void fail_op(struct connection *cxn, struct post_op *op, int err)
+{
+    struct network_request *rq = op->context;
+
+    if (rq && !is_rx_rq(cxn, rq))
+    {
+        fail_request(cxn, rq, err);
+    }
+}
+
+// returns true if any callbacks ran, they may have queued more posts
+static bool run_failed(struct connection *cxn)
+{
+    bool ran = false;
+
+    // a callback flushing posts itself doesn't get to run the rest in its middle
+    if (cxn->running_failed)
+    {
+        return false;
+    }
+    cxn->running_failed = true;
+
+    while (cxn->failed_head)
+    {
+        struct pending_op *failed = cxn->failed_head;
+        struct network_request *rq = failed->op.context;
+
+        cxn->failed_head = failed->next;
+        if (!cxn->failed_head)
+        {
+            cxn->failed_tail = NULL;
+        }
+        obj_free(&pending_pool, failed);
+
+        run_callback(rq);
+        ran = true;
+    }
+
+    cxn->running_failed = false;
+
+    return ran;
+}
+
+static void unclaim_post(struct connection *cxn, struct post_op *op)
+{
+    if (op_needs_credit(cxn, op))
+    {
+        cxn->send_credits++;
+    }
+}
+
+// takes what op needs to go out now, its send credit. Returns -FI_EAGAIN when it has to wait for
+// progress, or the error it fails with on a dead connection
+static ssize_t claim_post(struct connection *cxn, struct post_op *op)
+{
+    if (cxn->failed)
+    {
+        return cxn->failed;
+    }
+
+    if (op_needs_credit(cxn, op))
+    {
+        if (cxn->send_credits == 0)
+        {
+            return -FI_EAGAIN;
+        }
+        cxn->send_credits--;
+    }
+
+    if (fault_enabled && fault_hit(FAULT_EAGAIN))
+    {
+        unclaim_post(cxn, op);
+        return -FI_EAGAIN;
+    }
+
+    return 0;
+}
+
+// op has been claimed. Returns -FI_EAGAIN with the claim given back when the provider is full,
+// anything else means it's been handled
+static ssize_t post_claimed(struct connection *cxn, struct post_op *op, uint64_t more)
+{
+    uint64_t flags = (op->flags & ~FI_MORE) | more;
+    ssize_t rc;
+
+    if (op->type == POST_SEND)
+    {
+        ((struct network_cmd *)op->buf)->credits = cxn->credits_to_return;
+
+        // most commands are just the header, small enough for the provider to copy inline
+        if (op->len <= cxn->ni->inject_size)
+        {
+            flags |= FI_INJECT;
+        }
+    }
+
+    rc = post_op(cxn, op, flags);
+    if (rc < 0)
+    {
+        unclaim_post(cxn, op);
+        if (rc != -FI_EAGAIN)
+        {
+            fprintf(stderr, "post type %d failed: %s\n", op->type, fi_strerror((int)-rc));
+            fail_op(cxn, op, rc);
+        }
+
+        return rc;
+    }
+
+    if (op->type == POST_SEND)
+    {
+        cxn->credits_to_return = 0;
+    }
+    else if (op->type == POST_RECV && is_rx_rq(cxn, op->context))
+    {
+        // only advertise the receive once it's really posted
+        cxn->credits_to_return++;
+    }
+
+    return 0;
+}
+
+static void pending_append(struct connection *cxn, struct post_op *op)
+{
+    op_list_append(&cxn->pending_head, &cxn->pending_tail, op);
+}
+
+// FI_MORE only batches posts to the same queue, receives go to the endpoint's receive queue and
+// everything else to its transmit queue
+static bool same_queue(const struct post_op *a, const struct post_op *b)
+{
+    return (a->type == POST_RECV) == (b->type == POST_RECV);
+}
+
+/*
+Posts go out in order, each with FI_MORE so the provider can ring the doorbell once for the lot.
+An op only gets FI_MORE once the one after it has been claimed and goes to the same queue, so a
+burst always ends with a post without it, a send followed by a receive included. The provider
+never sits on posts nothing is going to follow, the reply returning the peer's credits among them.
+The exception is the provider refusing that last post with -FI_EAGAIN, it's then at the head of
+the pending list and goes out on the next flush.
+
+Posts that would block stay on the pending list, in order, and are retried on the next flush.
+*/
+static void post_flush_pending(struct connection *cxn)
+{
+    bool claimed = false;
+
+    while (cxn->pending_head)
+    {
+        struct pending_op *pending = cxn->pending_head;
+        ssize_t rc = claimed ? 0 : claim_post(cxn, &pending->op);
+
+        if (rc == -FI_EAGAIN)
+        {
+            break;
+        }
+        else if (rc < 0)
+        {
+            fail_op(cxn, &pending->op, rc);
+        }
+        else
+        {
+            claimed = pending->next && same_queue(&pending->op, &pending->next->op) &&
+                      claim_post(cxn, &pending->next->op) == 0;
+            if (post_claimed(cxn, &pending->op, claimed ? FI_MORE : 0) == -FI_EAGAIN)
+            {
+                if (claimed)
+                {
+                    unclaim_post(cxn, &pending->next->op);
+                }
+                break;
+            }
+        }
+
+        cxn->pending_head = pending->next;
+        if (!cxn->pending_head)
+        {
+            cxn->pending_tail = NULL;
+        }
+        obj_free(&pending_pool, pending);
+    }
+}
+
+static void post_flush_queue(struct connection *cxn)
+{
+    struct post_queue *pq = &cxn->post_queue;
+    bool claimed = false;
+    int i;
+
+    // anything already waiting goes first
+    if (cxn->pending_head)
+    {
+        for (i = 0; i < pq->count; i++)
+        {
+            pending_append(cxn, &pq->ops[i]);
+        }
+        pq->count = 0;
+        post_flush_pending(cxn);
+        return;
+    }
+
+    for (i = 0; i < pq->count; i++)
+    {
+        struct post_op *op = &pq->ops[i];
+        ssize_t rc = claimed ? 0 : claim_post(cxn, op);
+
+        if (rc == -FI_EAGAIN)
+        {
+            break;
+        }
+        else if (rc < 0)
+        {
+            fail_op(cxn, op, rc);
+            continue;
+        }
+
+        claimed = i + 1 < pq->count && same_queue(op, &pq->ops[i + 1]) &&
+                  claim_post(cxn, &pq->ops[i + 1]) == 0;
+        if (post_claimed(cxn, op, claimed ? FI_MORE : 0) == -FI_EAGAIN)
+        {
+            if (claimed)
+            {
+                unclaim_post(cxn, &pq->ops[i + 1]);
+            }
+            break;
+        }
+    }
+
+    for (; i < pq->count; i++)
+    {
+        pending_append(cxn, &pq->ops[i]);
+    }
+    pq->count = 0;
+}
+
+/*
+Credits only travel on sends, but a server reposts receives it never answers: a PUT completed with
+immediate data has no reply, and neither has a RECLAIM_ACK. Once half the peer's credits are owed
+and nothing is waiting to carry them, they go back in a CREDITS message of their own, before the
+peer runs dry with no way to ask.
+*/
+static bool credits_owed(struct connection *cxn)
+{
+    return cxn->ni->is_server && (cxn->remote_keys.features & FEATURE_RECLAIM) && !cxn->failed &&
+           !cxn->pending_head && cxn->credits_to_return > 0 &&
+           cxn->credits_to_return >= (cxn->rx_depth + 1) / 2;
+}
+
+void post_flush(struct connection *cxn)
+{
+    // the callbacks of failed requests may post again, which fails in turn on a dead connection
+    do
+    {
+        post_flush_queue(cxn);
+        if (credits_owed(cxn) && ctl_send(cxn, CREDITS, 0))
+        {
+            post_flush_queue(cxn);
+        }
+    } while (run_failed(cxn));
+}
+
+void post_flush_all(struct net_info *ni)
+{
+    struct connection *cxn = ni->connection_list;
+    while (cxn)
+    {
+        post_flush(cxn);
+        cxn = cxn->next;
+    }
+}
+
+static struct post_op *post_enqueue(struct connection *cxn)
+{
+    struct post_queue *pq = &cxn->post_queue;
+
+    if (pq->count == POST_QUEUE_DEPTH)
+    {
+        post_flush(cxn);
+    }
+
+    return &pq->ops[pq->count++];
+}
+
+// when posts aren't deferred, the op goes out on its own straight away
+static void post_commit(struct connection *cxn)
+{
+    if (!cxn->ni->defer_posts)
+    {
+        post_flush(cxn);
+    }
+}
+
+static void cmd_post(struct connection *cxn, enum post_op_type type, size_t len, void *context)
+{
+    struct post_op *op = post_enqueue(cxn);
+
+    *op = (struct post_op){
+        .type = type,
+        .buf = cxn->cmd_buf,
+        .len = len,
+        .desc = fi_mr_desc(get_cmd_mr()),
+        .context = context,
+    };
+
+    post_commit(cxn);
+}
+
+static void rx_post(struct connection *cxn, int slot)
+{
+    struct post_op *op = post_enqueue(cxn);
+
+    *op = (struct post_op){
+        .type = POST_RECV,
+        .buf = cxn->rx_bufs[slot],
+        .len = sizeof(struct network_cmd),
+        .desc = fi_mr_desc(get_cmd_mr()),
+        .context = &cxn->rx_rqs[slot],
+    };
+
+    post_commit(cxn);
+}
+
+int cmd_rx_init(struct connection *cxn, int depth)
+{
+    if (depth < 1 || depth > MAX_RX_DEPTH)
+    {
+        depth = depth < 1 ? 1 : MAX_RX_DEPTH;
+    }
+
+    for (int i = 0; i < depth; i++)
+    {
+        cxn->rx_bufs[i] = alloc_cmd_buf();
+        if (!cxn->rx_bufs[i])
+        {
+            fprintf(stderr, "out of cmd buffers for client %d\n", cxn->client_id);
+            cmd_rx_close(cxn);
+
+            return -FI_ENOMEM;
+        }
+
+        cxn->rx_rqs[i] = (struct network_request){.cxn = cxn};
+        rx_post(cxn, i);
+    }
+
+    // the peer learns about these from the handshake, only reposts are returned as credits
+    cxn->rx_depth = depth;
+    cxn->credits_to_return -= depth;
+
+    return 0;
+}
+
+void cmd_rx_close(struct connection *cxn)
+{
+    for (int i = 0; i < MAX_RX_DEPTH; i++)
+    {
+        free_cmd_buf(cxn->rx_bufs[i]);
+        cxn->rx_bufs[i] = NULL;
+    }
+    free_cmd_buf(cxn->ctl_rq.rq_data);
+    cxn->ctl_rq.rq_data = NULL;
+
+    while (cxn->pending_head)
+    {
+        struct pending_op *pending = cxn->pending_head;
+        cxn->pending_head = pending->next;
+        obj_free(&pending_pool, pending);
+    }
+    cxn->pending_tail = NULL;
+
+    // the connection is going away with its requests' owners
+    while (cxn->failed_head)
+    {
+        struct pending_op *failed = cxn->failed_head;
+        cxn->failed_head = failed->next;
+        obj_free(&pending_pool, failed);
+    }
+    cxn->failed_tail = NULL;
+
+    cxn->post_queue.count = 0;
+    cxn->rx_depth = 0;
+}
+
+/*
+Idle server connections keep a single receive posted and give every other command buffer back
+to the pool. The peer holds credits for those receives, so they're taken back first: the server
+sends RECLAIM asking for all but one of them, and the peer answers RECLAIM_ACK with the ones it
+can spare, keeping one for its next command, and stops counting them. Only those receives are
+cancelled, the peer can still send into every one it has credits for. A command arriving in
+between calls the shrink off, and the credits given up are returned with the next message
+instead. A peer that can't answer leaves the RECLAIM outstanding until its next command.
+
+The refills on the peer's next command return credits like any repost, so a slot that can't get
+a buffer just leaves the peer a credit short. Peers that don't ask for FEATURE_RECLAIM are never
+shrunk.
+*/
+static void ctl_sent(struct network_request *rq)
+{
+    free_cmd_buf(rq->rq_data);
+    rq->rq_data = NULL;
+}
+
+// a RECLAIM, RECLAIM_ACK or CREDITS, sent from a spare cmd buffer so the working command is left
+// alone. False if there's no buffer, or the last one is still out
+static bool ctl_send(struct connection *cxn, uint8_t type, uint32_t reclaim)
+{
+    struct network_cmd *cmd;
+    struct post_op *op;
+
+    if (cxn->ctl_rq.rq_data || !(cmd = alloc_cmd_buf()))
+    {
+        return false;
+    }
+
+    memset(cmd, 0, offsetof(struct network_cmd, batch));
+    cmd->type = type;
+    cmd->reclaim = reclaim;
+    cxn->ctl_rq = (struct network_request){.cxn = cxn, .callback = ctl_sent, .rq_data = cmd};
+
+    op = post_enqueue(cxn);
+    *op = (struct post_op){
+        .type = POST_SEND,
+        .buf = cmd,
+        .len = network_cmd_size(cmd),
+        .desc = fi_mr_desc(get_cmd_mr()),
+        .context = &cxn->ctl_rq,
+    };
+    post_commit(cxn);
+
+    return true;
+}
+
+static void rx_refill(struct connection *cxn, int slot)
+{
+    cxn->rx_bufs[slot] = alloc_cmd_buf();
+    if (!cxn->rx_bufs[slot])
+    {
+        fprintf(stderr, "out of cmd buffers refilling client %d\n", cxn->client_id);
+        return;
+    }
+
+    rx_post(cxn, slot);
+}
+
+bool cmd_rx_shrink(struct connection *cxn)
+{
+    if (!(cxn->remote_keys.features & FEATURE_RECLAIM) || cxn->reclaiming)
+    {
+        return false;
+    }
+
+    cxn->reclaiming = ctl_send(cxn, RECLAIM, cxn->rx_depth - 1);
+    return cxn->reclaiming;
+}
+
+// the peer asks for credits back. One credit goes on the answer and one is kept for the next
+// command, the peer only returns credits when it sends, so giving up the last one would leave
+// this side unable to ever send again. Without any to spare the RECLAIM goes unanswered
+static void reclaim_answer(struct connection *cxn, uint32_t wanted)
+{
+    int spare = cxn->send_credits - 2;
+
+    if (spare > (int)wanted)
+    {
+        spare = wanted;
+    }
+    if (spare <= 0)
+    {
+        return;
+    }
+
+    if (ctl_send(cxn, RECLAIM_ACK, spare))
+    {
+        cxn->send_credits -= spare;
+    }
+}
+
+// the peer gave up credits for count receives, slot holds its answer and is posted again already
+static void reclaim_done(struct connection *cxn, int slot, uint32_t count)
+{
+    // everything reposted has to be out before it can be cancelled
+    post_flush(cxn);
+    if (!cxn->reclaiming || cxn->pending_head)
+    {
+        cxn->reclaiming = false;
+        cxn->credits_to_return += count;
+        return;
+    }
+    cxn->reclaiming = false;
+
+    // the cancelled receives complete with FI_ECANCELED, see rx_cancelled
+    for (int i = cxn->rx_depth - 1; i >= 0 && count > 0; i--)
+    {
+        if (i != slot && cxn->rx_bufs[i])
+        {
+            fi_cancel(&cxn->ep->fid, &cxn->rx_rqs[i]);
+            count--;
+        }
+    }
+
+    free_cmd_buf(cxn->cmd_buf);
+    cxn->cmd_buf = NULL;
+    cxn->idle = true;
+}
+
+static void rx_cancelled(struct connection *cxn, int slot)
+{
+    free_cmd_buf(cxn->rx_bufs[slot]);
+    cxn->rx_bufs[slot] = NULL;
+
+    // the peer came back before the cancel finished
+    if (!cxn->idle)
+    {
+        rx_refill(cxn, slot);
+    }
+}
+
+static void rx_grow(struct connection *cxn)
+{
+    cxn->idle = false;
+    for (int i = 0; i < cxn->rx_depth; i++)
+    {
+        if (!cxn->rx_bufs[i])
+        {
+            rx_refill(cxn, i);
+        }
+    }
+}
+
+// hand the oldest received message to the waiting request and repost its receive
+static void rx_deliver(struct connection *cxn)
+{
+    while (cxn->recv_rq && cxn->rx_ready_count > 0)
+    {
+        struct network_request *rq = cxn->recv_rq;
+        int slot = cxn->rx_ready[0];
+        struct network_cmd *cmd = cxn->rx_bufs[slot];
+
+        cxn->rx_ready_count--;
+        memmove(cxn->rx_ready, cxn->rx_ready + 1, cxn->rx_ready_count * sizeof(int));
+
+        // the message becomes the working command and the receive takes the old one, or a fresh
+        // buffer if the connection gave its working command back while idle
+        cxn->rx_bufs[slot] = cxn->cmd_buf ? cxn->cmd_buf : alloc_cmd_buf();
+        cxn->cmd_buf = cmd;
+        if (cxn->rx_bufs[slot])
+        {
+            rx_post(cxn, slot);
+        }
+        else
+        {
+            fprintf(stderr, "out of cmd buffers, client %d runs one receive short\n",
+                    cxn->client_id);
+        }
+
+        cxn->recv_rq = NULL;
+        run_callback(rq);
+    }
+}
+
+static void rx_complete(struct connection *cxn, int slot)
+{
+    struct network_cmd *cmd = cxn->rx_bufs[slot];
+
+    cxn->send_credits += cmd->credits;
+
+    // the transport's own messages, the receive goes straight back up
+    if (cmd->type == RECLAIM || cmd->type == RECLAIM_ACK || cmd->type == CREDITS)
+    {
+        uint8_t type = cmd->type;
+        uint32_t reclaim = cmd->reclaim;
+
+        rx_post(cxn, slot);
+        if (type == RECLAIM)
+        {
+            reclaim_answer(cxn, reclaim);
+        }
+        else if (type == RECLAIM_ACK)
+        {
+            reclaim_done(cxn, slot, reclaim);
+        }
+        return;
+    }
+
+    // a command calls off a shrink in progress
+    cxn->reclaiming = false;
+    cxn->rx_ready[cxn->rx_ready_count++] = slot;
+    cxn->last_active = time(NULL);
+
+    if (cxn->idle)
+    {
+        rx_grow(cxn);
+    }
+
+    rx_deliver(cxn);
+}
+
+// the next message from the peer is delivered to rq in cmd_buf, which must not be in use
 void cmd_recv(struct network_request *rq)
 {
-    fi_recv(rq->cxn->ep, rq->cxn->cmd_buf, sizeof(struct network_cmd), fi_mr_desc(get_cmd_mr()), 0,
-            rq);
+    if (rq->cxn->failed)
+    {
+        fail_request(rq->cxn, rq, rq->cxn->failed);
+        return;
+    }
+
+    rq->cxn->recv_rq = rq;
+    rx_deliver(rq->cxn);
 }
 
 void cmd_send(struct network_request *rq)
 {
-    fi_send(rq->cxn->ep, rq->cxn->cmd_buf, sizeof(struct network_cmd), fi_mr_desc(get_cmd_mr()), 0,
-            rq);
+    cmd_post(rq->cxn, POST_SEND, network_cmd_size(rq->cxn->cmd_buf), rq);
+}
+
+// send the command without a completion context, for when the reply drives the request instead
+void cmd_send_untracked(struct connection *cxn)
+{
+    cmd_post(cxn, POST_SEND, network_cmd_size(cxn->cmd_buf), NULL);
 }
 
 /*
@@ -26,116 +790,408 @@ region has been accessed by an RMA read or write operation.  However, immediate
 associated with an RMA write operation.  RMA writes with immediate data will generate a
 completion entry at the remote endpoint, so that the immediate data may be delivered."
 
-I haven't been able to get this to work with the sockets provider.
+Only used when the domain reports cq_data_size > 0, otherwise the PUT is followed by a reply
+message. Providers running in FI_RX_CQ_DATA mode consume a posted receive for the completion.
 */
-void bulk_op(struct network_request *rq, struct fi_msg_rma *msg, bool is_read)
+void bulk_op(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len, bool is_read,
+             uint64_t flags)
 {
-    struct iovec iov = {
-        .iov_base = rq->cxn->bulk_buf,
-        .iov_len = BULK_SIZE,
+    struct post_op *op = post_enqueue(rq->cxn);
+
+    *op = (struct post_op){
+        .type = is_read ? POST_READ : POST_WRITE,
+        .buf = buf,
+        .len = len,
+        .desc = get_buf_desc(buf),
+        .rma_iov = msg->rma_iov[0],
+        .data = msg->data,
+        .flags = flags,
+        .context = rq,
     };
-    void *desc = fi_mr_desc(get_bulk_mr());
 
-    msg->msg_iov = &iov;
-    msg->desc = &desc;
-    msg->iov_count = 1;
-    msg->context = rq;
+    post_commit(rq->cxn);
+}
+
+void bulk_read(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len)
+{
+    bulk_op(rq, msg, buf, len, 1, 0);
+}
+
+void bulk_write(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len)
+{
+    bulk_op(rq, msg, buf, len, 0, 0);
+}
+
+void bulk_write_imm(struct network_request *rq, struct fi_msg_rma *msg, void *buf, size_t len,
+                    uint64_t data)
+{
+    msg->data = data;
+    bulk_op(rq, msg, buf, len, 0, FI_REMOTE_CQ_DATA);
+}
+
+// native atomics operate on the 64-bit word at cmd->op_addr in the server's store, using the
+// operand, compare and result slots of the registered cmd buffer. They're queued like any other
+// post, so they stay ordered behind whatever was deferred before them
+static void atomic_post(struct network_request *rq, enum post_op_type type)
+{
+    struct connection *cxn = rq->cxn;
+    struct network_cmd *cmd = cxn->cmd_buf;
+    struct post_op *op = post_enqueue(cxn);
+
+    *op = (struct post_op){
+        .type = type,
+        .buf = cmd,
+        .desc = fi_mr_desc(get_cmd_mr()),
+        .rma_iov =
+            {
+                .addr = cxn->remote_keys.store_addr + cmd->op_addr,
+                .len = sizeof(cmd->result),
+                .key = cxn->remote_keys.store_key,
+            },
+        .context = rq,
+    };
+
+    post_commit(cxn);
+}
+
+void remote_fetch_add(struct network_request *rq)
+{
+    atomic_post(rq, POST_FETCH_ADD);
+}
+
+void remote_compare_swap(struct network_request *rq)
+{
+    atomic_post(rq, POST_COMPARE_SWAP);
+}
 
-    if (is_read)
+static void run_callback(struct network_request *rq)
+{
+    if (rq && rq->callback != NULL)
     {
-        fi_readmsg(rq->cxn->ep, msg, 0);
+        // the callback usually replaces itself, it's charged under the one that ran
+        void (*callback)(struct network_request *) = rq->callback;
+        struct prof_frame frame;
+
+        TRACE("running callback, cb=%p\n", callback);
+        if (prof_enabled)
+        {
+            prof_begin(&frame);
+        }
+        callback(rq);
+        if (prof_enabled)
+        {
+            prof_end_callback(&frame, (void *)callback);
+        }
     }
     else
     {
-        fi_writemsg(rq->cxn->ep, msg, 0);
+        TRACE("request done\n");
     }
 }
 
-void bulk_read(struct network_request *rq, struct fi_msg_rma *msg)
+// completions taken from the cq per fi_cq_read
+#define CQ_READ_BATCH 16
+
+// flags and data are only meaningful for FI_CQ_FORMAT_DATA completions
+static void handle_completion(struct connection *cxn, void *context, uint64_t flags,
+                             uint64_t data)
 {
-    bulk_op(rq, msg, 1);
+    struct network_request *rq = context;
+
+    if (flags & FI_REMOTE_CQ_DATA)
+    {
+        // the request is parked on the connection, but with FI_RX_CQ_DATA the write also
+        // used up one of our posted receives
+        if (rq && is_rx_rq(cxn, rq))
+        {
+            rx_post(cxn, rq - cxn->rx_rqs);
+        }
+
+        rq = cxn->imm_rq;
+        TRACE("immediate data - client #%d data %llx rq %p\n", cxn->client_id,
+              (unsigned long long)data, rq);
+
+        cxn->imm_rq = NULL;
+        cxn->imm_data = data;
+        run_callback(rq);
+    }
+    else if (is_rx_rq(cxn, rq))
+    {
+        rx_complete(cxn, rq - cxn->rx_rqs);
+    }
+    else
+    {
+        run_callback(rq);
+    }
 }
 
-void bulk_write(struct network_request *rq, struct fi_msg_rma *msg)
+/*
+Called when the connection can't carry anything more, after a cq error or a shutdown. Requests
+waiting on the peer fail now and every later post or receive fails as it's made, with their
+callbacks run from post_flush. Completions for work the provider already has still arrive. The
+peer is told with fi_shutdown so it can fail its own requests.
+*/
+void connection_fail(struct connection *cxn, int err)
 {
-    bulk_op(rq, msg, 0);
+    struct network_request *recv_rq = cxn->recv_rq;
+    struct network_request *imm_rq = cxn->imm_rq;
+
+    if (cxn->failed)
+    {
+        return;
+    }
+
+    fprintf(stderr, "connection %d failed: %s\n", cxn->client_id, fi_strerror(-err));
+    cxn->failed = err;
+    cxn->recv_rq = NULL;
+    cxn->imm_rq = NULL;
+
+    if (recv_rq)
+    {
+        fail_request(cxn, recv_rq, err);
+    }
+    if (imm_rq && imm_rq != recv_rq)
+    {
+        fail_request(cxn, imm_rq, err);
+    }
+
+    fi_shutdown(cxn->ep, 0);
 }
 
-void process_cq_events(struct connection *cxn)
+// an operation that failed leaves the endpoint in an unknown state, the connection goes with it
+static void cq_error(struct connection *cxn, struct network_request *rq, int err)
 {
-    struct fi_cq_data_entry cqde;
-    int rc;
+    if (err == -FI_ECANCELED && rq && is_rx_rq(cxn, rq))
+    {
+        rx_cancelled(cxn, rq - cxn->rx_rqs);
+        return;
+    }
+
+    connection_fail(cxn, err);
+    if (rq && !is_rx_rq(cxn, rq))
+    {
+        fail_request(cxn, rq, err);
+    }
+}
 
-    cqde.op_context = NULL;
+static void on_completion(struct connection *cxn, void *context, uint64_t flags, uint64_t data)
+{
+    struct network_request *rq = context;
 
-    if (!cxn)
+    if (cxn->closing)
     {
         return;
     }
 
-    do
+    if (fault_enabled && !cxn->failed && fault_hit(FAULT_SHUTDOWN))
+    {
+        connection_fail(cxn, -FI_ECONNRESET);
+    }
+
+    // only operations some request is waiting on, receives and immediate data are left alone
+    if (fault_enabled && rq && !is_rx_rq(cxn, rq) && !(flags & FI_REMOTE_CQ_DATA) &&
+        fault_hit(FAULT_CQ_ERROR))
+    {
+        cq_error(cxn, rq, -FI_EIO);
+        return;
+    }
+
+    if (cxn->ni->cq_format == FI_CQ_FORMAT_DATA &&
+        !(flags & (FI_REMOTE_CQ_DATA | FI_RECV | FI_SEND | FI_READ | FI_WRITE | FI_ATOMIC)))
+    {
+        fprintf(stderr, "unknown cq flags: %llu - %s\n", (unsigned long long)flags,
+                fi_tostr(&flags, FI_TYPE_CQ_EVENT_FLAGS));
+        return;
+    }
+
+    handle_completion(cxn, context, flags, data);
+}
+
+static void delay_completion(struct net_info *ni, struct connection *cxn, void *context,
+                             uint64_t flags, uint64_t data)
+{
+    struct delayed_completion *delayed = malloc(sizeof(*delayed));
+
+    *delayed = (struct delayed_completion){
+        .cxn = cxn,
+        .context = context,
+        .flags = flags,
+        .data = data,
+    };
+
+    if (ni->delayed_tail)
     {
-        rc = fi_cq_read(cxn->cq, &cqde, 1);
+        ni->delayed_tail->next = delayed;
+    }
+    else
+    {
+        ni->delayed_head = delayed;
+    }
+    ni->delayed_tail = delayed;
+}
+
+static void deliver_delayed(struct net_info *ni)
+{
+    struct delayed_completion *delayed = ni->delayed_head;
+
+    ni->delayed_head = NULL;
+    ni->delayed_tail = NULL;
+
+    while (delayed)
+    {
+        struct delayed_completion *next = delayed->next;
+
+        on_completion(delayed->cxn, delayed->context, delayed->flags, delayed->data);
+        free(delayed);
+        delayed = next;
+    }
+}
+
+// drops held back completions for cxn before it's freed, or all of them if cxn is NULL
+void delayed_forget(struct net_info *ni, struct connection *cxn)
+{
+    struct delayed_completion **prev = &ni->delayed_head;
+
+    ni->delayed_tail = NULL;
+    while (*prev)
+    {
+        struct delayed_completion *delayed = *prev;
+
+        if (!cxn || delayed->cxn == cxn)
+        {
+            *prev = delayed->next;
+            free(delayed);
+        }
+        else
+        {
+            ni->delayed_tail = delayed;
+            prev = &delayed->next;
+        }
+    }
+}
+
+// reads cq until it's empty. cxn is the connection owning cq, or NULL for the server's shared
+// cq, where completions are routed by their request's connection instead
+static void drain_cq(struct net_info *ni, struct fid_cq *cq, struct connection *cxn)
+{
+    union
+    {
+        struct fi_cq_entry ctx[CQ_READ_BATCH];
+        struct fi_cq_data_entry data[CQ_READ_BATCH];
+    } entries;
+    bool data_format = ni->cq_format == FI_CQ_FORMAT_DATA;
+    bool delaying = false;
+    int rc;
+
+    deliver_delayed(ni);
+
+    while (!delaying)
+    {
+        rc = fi_cq_read(cq, &entries, CQ_READ_BATCH);
         if (rc == -FI_EAGAIN)
         {
-            return;
+            break;
         }
         else if (rc == -FI_EAVAIL)
         {
             struct fi_cq_err_entry cqee;
-            rc = fi_cq_readerr(cxn->cq, &cqee, 0);
+            rc = fi_cq_readerr(cq, &cqee, 0);
             if (rc < 0)
             {
                 fprintf(stderr, "warning - fi_cq_readerr: rc=%d\n", rc);
+                break;
             }
 
             struct network_request *rq = cqee.op_context;
-            rq->rq_res = cqee.err;
+            struct connection *owner = cxn ? cxn : rq ? rq->cxn : NULL;
+
+            if (cqee.err != FI_ECANCELED)
+            {
+                fprintf(stderr, "Request error detected: %s [%d]\n",
+                        fi_cq_strerror(cq, cqee.prov_errno, cqee.err_data, NULL, 0), cqee.err);
+            }
 
-            fprintf(stderr, "Request error detected: %s [%d]\n",
-                    fi_cq_strerror(cxn->cq, cqee.prov_errno, cqee.err_data, NULL, 0), cqee.err);
-            return;
+            // an untracked send on the shared cq can't be traced back to its connection
+            if (owner && !owner->closing)
+            {
+                cq_error(owner, rq, -(int)cqee.err);
+            }
+            continue;
         }
         else if (rc < 0)
         {
             FI_GOTO(done, "fi_cq_read");
         }
 
-        if (cqde.flags & (FI_RECV | FI_SEND | FI_READ | FI_WRITE))
+        for (int i = 0; i < rc; i++)
         {
-            struct network_request *rq = cqde.op_context;
+            void *context = data_format ? entries.data[i].op_context : entries.ctx[i].op_context;
+            uint64_t flags = data_format ? entries.data[i].flags : 0;
+            uint64_t data = data_format ? entries.data[i].data : 0;
+            struct connection *owner = cxn;
 
-            printf("message - client #%d len %d rq %p\n", cxn->client_id, cqde.len, rq);
-            fprintf(stderr, "cq flags: %d - %s\n", cqde.flags,
-                    fi_tostr(&cqde.flags, FI_TYPE_CQ_EVENT_FLAGS));
-
-            if (rq && rq->callback != NULL)
+            if (!owner)
             {
-                printf("running callback, cb=%p\n", rq->callback);
-                rq->callback(rq);
+                // nothing to do for untracked sends
+                if (!context)
+                {
+                    continue;
+                }
+                owner = ((struct network_request *)context)->cxn;
             }
-            else
+
+            // the rest of the batch goes after this one so completions keep their order
+            delaying = delaying || (fault_enabled && fault_hit(FAULT_DELAY));
+            if (delaying)
             {
-                printf("request done\n");
+                delay_completion(ni, owner, context, flags, data);
+                continue;
             }
+
+            on_completion(owner, context, flags, data);
         }
-        else
+
+        // a short read means the cq is drained
+        if (rc < CQ_READ_BATCH)
         {
-            fprintf(stderr, "unknown cq flags: %d - %s\n", cqde.flags,
-                    fi_tostr(&cqde.flags, FI_TYPE_CQ_EVENT_FLAGS));
-            fprintf(stderr, "buf: %*s\n", cqde.len - 1, cqde.buf);
-            fprintf(stderr, "data: %s\n", cqde.data);
             break;
         }
-    } while (rc != 0);
+    }
 
 done:
     return;
 }
 
+void process_cq_events(struct connection *cxn)
+{
+    if (!cxn)
+    {
+        return;
+    }
+
+    if (cxn->cq == cxn->ni->cq)
+    {
+        process_all_cq_events(cxn->ni);
+        return;
+    }
+
+    drain_cq(cxn->ni, cxn->cq, cxn);
+
+    // everything the callbacks queued goes out together
+    post_flush(cxn);
+}
+
 void process_all_cq_events(struct net_info *ni)
 {
     struct connection *cxn = ni->connection_list;
+
+    if (ni->cq)
+    {
+        drain_cq(ni, ni->cq, NULL);
+        post_flush_all(ni);
+        return;
+    }
+
     while (cxn)
     {
         process_cq_events(cxn);